@@ -0,0 +1,184 @@
+#ifndef __RS_REFILLS_FACING_COUNTER_H__
+#define __RS_REFILLS_FACING_COUNTER_H__
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <Eigen/Geometry>
+
+#include <pcl/point_types.h>
+#include <pcl/point_cloud.h>
+#include <pcl/PointIndices.h>
+#include <pcl/segmentation/euclidean_cluster_comparator.h>
+
+#include <rs_refills/utils/crop_box.h>
+#include <rs_refills/utils/organized_transform.h>
+#include <rs_refills/utils/object_pool.h>
+#include <rs_refills/utils/stage_profiler.h>
+
+namespace rs_refills
+{
+
+/**
+ * @brief Core of the ProductCounter annotator, free of ROS, tf, Prolog and
+ *  the CAS: crops a frame to the facing between two separators and splits
+ *  the clustered products in chunks of the product depth.
+ */
+class FacingCounter
+{
+public:
+  typedef pcl::PointCloud<pcl::PointXYZRGBA> Cloud;
+  typedef pcl::PointCloud<pcl::Normal> Normals;
+
+  enum Stage
+  {
+    STAGE_TRANSFORM_CROP,
+    STAGE_REFINE_CROP,
+    STAGE_CLUSTERING
+  };
+
+  struct BoundingBox
+  {
+    pcl::PointXYZ minPt, maxPt;
+  };
+
+  /**
+   * @param profiler record the stages into this one instead of an own
+   *  profiler, e.g. to sum up several counters working on one frame
+   */
+  explicit FacingCounter(StageProfiler *profiler = NULL);
+
+  /**
+   * @brief the facing in the frame of the shelf system
+   * @param separator position of the left separator
+   * @param width distance to the next separator
+   * @param depth height of the product, along z
+   * @param shelfType "hanging" or "standing", anything else gives an empty box
+   */
+  static CropBox facingBox(const Eigen::Vector3f &separator, double width, double depth,
+                           const std::string &shelfType);
+
+  /**
+   * @brief transform into the shelf frame and keep only the facing
+   */
+  void filterCloud(const Cloud &cloud, const Eigen::Affine3f &camToWorld, const CropBox &box);
+
+  /**
+   * @brief keep only the facing of a cloud that is already in the shelf frame;
+   *  the cloud is shared, not copied, and must not change until clear()
+   * @param valid valid points of shelfCloud
+   */
+  void cropCloud(const Cloud::ConstPtr &shelfCloud, const ValidityMask &valid, const CropBox &box);
+
+  /**
+   * @brief crop the filtered cloud further without transforming it again,
+   *  e.g. once the product height is known
+   * @return number of points left
+   */
+  size_t refineCrop(const CropBox &box);
+
+  /**
+   * @brief cluster the filtered cloud and split the clusters in chunks of
+   *  objDepth (on y)
+   */
+  void clusterCloud(double objDepth, const Normals::ConstPtr &normals);
+
+  /**
+   * @brief forget the results of the last frame
+   */
+  void clear();
+
+  /**
+   * @brief the frame with only the points of the facing; after cropCloud
+   *  this copies the shared cloud on first use
+   */
+  Cloud::Ptr filteredCloud();
+
+  const ValidityMask &validMask() const
+  {
+    return validMask_;
+  }
+
+  /**
+   * @brief valid until the next clear()
+   */
+  const std::vector<pcl::PointIndicesPtr> &clusterIndices() const
+  {
+    return clusterIndices_;
+  }
+
+  const std::vector<BoundingBox> &clusterBoxes() const
+  {
+    return clusterBoxes_;
+  }
+
+  StageProfiler &profiler()
+  {
+    return *profiler_;
+  }
+
+  /**
+   * @brief index lists created by the frame arena so far, flat in steady state
+   */
+  uint64_t allocations() const
+  {
+    return indexPool_.allocations();
+  }
+
+private:
+  Cloud::Ptr cloudFiltered_;
+  //the frame validMask_ refers to, cloudFiltered_ or the cloud of cropCloud
+  Cloud::ConstPtr source_;
+  //whether cloudFiltered_ holds the points of source_ inside the facing
+  bool materialized_;
+  //points of cloudFiltered_ inside the facing
+  ValidityMask validMask_;
+
+  //the image rectangle holding the facing, segmentation runs on it only
+  Cloud::Ptr roiCloud_;
+  Normals::Ptr roiNormals_;
+
+  std::vector<pcl::PointIndicesPtr> clusterIndices_;
+  std::vector<BoundingBox> clusterBoxes_;
+  //frame arena for clusterIndices_, reset by clear()
+  ObjectPool<pcl::PointIndices> indexPool_;
+
+  //scratch of clusterCloud, kept between frames so that the buffers keep
+  //their capacity; the counts of the current frame are local to clusterCloud
+  typedef pcl::EuclideanClusterComparator<pcl::PointXYZRGBA, pcl::Normal, pcl::Label> Comparator;
+  Comparator::Ptr ecc_;
+  pcl::PointCloud<pcl::Label>::Ptr inputLabels_, outputLabels_;
+  std::vector<bool> ignoreLabels_;
+  std::vector<pcl::PointIndices> segments_;
+
+  //clusters of similar depth merged into one
+  struct MergedCluster
+  {
+    Eigen::Vector3d sum;   //of the finite points
+    size_t count, size;    //finite points, all points
+    std::vector<int> members;
+  };
+  std::vector<MergedCluster> merged_;
+  std::vector<std::vector<int>> mergedIndices_;
+
+  //a merged cluster split in slices of the product depth along y
+  struct ClusterSlices
+  {
+    Eigen::Vector3f min, max;
+    int count;
+    std::vector<BoundingBox> boxes;
+    std::vector<std::vector<int>> indices;
+  };
+  std::vector<ClusterSlices> slices_;
+
+  static void sliceCluster(const Cloud &cloud, const std::vector<int> &cluster, double objDepth,
+                           ClusterSlices &out);
+
+  std::unique_ptr<StageProfiler> ownProfiler_;
+  StageProfiler *profiler_;
+};
+
+}
+
+#endif /* __RS_REFILLS_FACING_COUNTER_H__ */
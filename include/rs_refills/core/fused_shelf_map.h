@@ -0,0 +1,91 @@
+#ifndef __RS_REFILLS_FUSED_SHELF_MAP_H__
+#define __RS_REFILLS_FUSED_SHELF_MAP_H__
+
+#include <unordered_map>
+#include <stdint.h>
+
+#include <Eigen/Core>
+
+#include <pcl/point_types.h>
+#include <pcl/point_cloud.h>
+
+#include <rs_refills/utils/hash_voxel_grid.h>
+
+namespace rs_refills
+{
+
+/**
+ * @brief Sparse voxel hash fusing the shelf edges of all frames of a scan of
+ *  one shelf system. A voxel keeps the sum of its points and the number of
+ *  frames it was seen in; noise seen in only a few frames is dropped when
+ *  the map is extracted, so the frames need no outlier removal of their own.
+ *  Memory is bounded by maxVoxels: when full, voxels seen in a single, older
+ *  frame are evicted first, new voxels are rejected if that is not enough.
+ */
+class FusedShelfMap
+{
+public:
+  typedef pcl::PointCloud<pcl::PointXYZRGBA> Cloud;
+
+  struct Parameters
+  {
+    float leafSize;
+    int minObservations;   //frames a voxel has to be seen in to be extracted
+    size_t maxVoxels;
+
+    Parameters(): leafSize(0.02f), minObservations(3), maxVoxels(1 << 20)
+    {
+    }
+  };
+
+  explicit FusedShelfMap(const Parameters &params = Parameters());
+
+  /**
+   * @brief fuse the edges of one frame, in the frame of the shelf system
+   */
+  void addFrame(const Cloud &edges);
+
+  /**
+   * @brief centroids of the voxels seen in at least minObservations frames
+   */
+  void extract(Cloud &voxels) const;
+
+  void clear();
+
+  size_t size() const
+  {
+    return voxels_.size();
+  }
+
+  uint32_t frames() const
+  {
+    return frames_;
+  }
+
+  //points not fused because the map was full
+  uint64_t rejected() const
+  {
+    return rejected_;
+  }
+
+private:
+  struct Voxel
+  {
+    Eigen::Vector3f sum;
+    uint32_t points;
+    uint32_t observations;
+    uint32_t lastFrame;
+  };
+
+  Parameters params_;
+  std::unordered_map<uint64_t, Voxel> voxels_;
+  uint32_t frames_;
+  uint64_t rejected_;
+
+  uint64_t key(const Eigen::Vector3f &p) const;
+  void evict();
+};
+
+}
+
+#endif /* __RS_REFILLS_FUSED_SHELF_MAP_H__ */
@@ -0,0 +1,127 @@
+#ifndef __RS_REFILLS_SCAN_PIPELINE_H__
+#define __RS_REFILLS_SCAN_PIPELINE_H__
+
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <stdint.h>
+
+#include <rs_refills/core/shelf_line_detector.h>
+#include <rs_refills/utils/shelf_line_map.h>
+#include <rs_refills/utils/stage_profiler.h>
+
+namespace rs_refills
+{
+
+/**
+ * @brief Pipelined shelf line detection for a scan: frames are copied into a
+ *  bounded ring buffer, a pool of workers (each with its own
+ *  ShelfLineDetector) extracts the lines of a frame, and a single merger
+ *  thread folds them into the layer map in the order the frames were pushed,
+ *  so the map is the same as with sequential processing.
+ */
+class ScanPipeline
+{
+public:
+  typedef ShelfLineDetector::Cloud Cloud;
+
+  enum Stage
+  {
+    STAGE_EXTRACTION,
+    STAGE_MERGE,
+    STAGE_FRAME_LATENCY
+  };
+
+  struct Parameters
+  {
+    int workers;
+    size_t capacity;      //frames in the ring buffer
+    bool dropWhenFull;    //else push blocks until a frame is merged
+    ShelfLineDetector::Parameters detector;
+
+    Parameters(): workers(2), capacity(8), dropWhenFull(true)
+    {
+    }
+  };
+
+  explicit ScanPipeline(const Parameters &params = Parameters());
+
+  /**
+   * @brief stops the threads, frames that are not merged yet are lost
+   */
+  ~ScanPipeline();
+
+  /**
+   * @brief copy a frame into the ring buffer; frames are pushed by one thread
+   * @return false if the frame was dropped because the buffer was full
+   */
+  bool push(const Cloud &cloud, const Eigen::Affine3f &camToWorld);
+
+  /**
+   * @brief wait until every pushed frame is merged
+   */
+  void flush();
+
+  /**
+   * @brief flush and forget the layers of the scan
+   */
+  void reset();
+
+  /**
+   * @brief copy of the layers merged so far
+   */
+  ShelfLineMap lineMap() const;
+
+  uint64_t merged() const;
+
+  uint64_t dropped() const;
+
+  StageProfiler &profiler()
+  {
+    return profiler_;
+  }
+
+  /**
+   * @brief add the stage latencies of the detectors of all workers to profiler,
+   *  which has the stages of ShelfLineDetector
+   */
+  void mergeDetectorProfilers(StageProfiler &profiler) const;
+
+private:
+  struct Slot
+  {
+    Cloud::Ptr cloud;
+    Eigen::Affine3f camToWorld;
+    std::chrono::steady_clock::time_point pushed;
+    std::vector<ShelfLineDetector::LineObservation> observations;
+    bool done;
+  };
+
+  Parameters params_;
+  std::vector<Slot> slots_;
+  std::vector<std::unique_ptr<ShelfLineDetector>> detectors_;
+
+  //frame sequence numbers, slot of a frame is seq % capacity:
+  //merged_ <= taken_ <= pushed_ <= merged_ + capacity
+  uint64_t pushed_, taken_, merged_, dropped_;
+  bool stop_;
+  mutable std::mutex mutex_;
+  //workers wait for frames, the merger for finished ones, push and flush for merged ones
+  std::condition_variable frameQueued_, frameDone_, frameMerged_;
+
+  mutable std::mutex mapMutex_;
+  ShelfLineMap lineMap_;
+
+  StageProfiler profiler_;
+  std::vector<std::thread> threads_;
+
+  void work(ShelfLineDetector &detector);
+  void merge();
+};
+
+}
+
+#endif /* __RS_REFILLS_SCAN_PIPELINE_H__ */
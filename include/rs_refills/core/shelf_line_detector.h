@@ -0,0 +1,314 @@
+#ifndef __RS_REFILLS_SHELF_LINE_DETECTOR_H__
+#define __RS_REFILLS_SHELF_LINE_DETECTOR_H__
+
+#include <vector>
+#include <stdint.h>
+
+#include <Eigen/Geometry>
+
+#include <opencv2/core/core.hpp>
+
+#include <pcl/point_types.h>
+#include <pcl/point_cloud.h>
+#include <pcl/PointIndices.h>
+
+#include <rs_refills/utils/crop_box.h>
+#include <rs_refills/utils/organized_transform.h>
+#include <rs_refills/utils/object_pool.h>
+#include <rs_refills/utils/hash_voxel_grid.h>
+#include <rs_refills/utils/nan_boundary.h>
+#include <rs_refills/utils/line_extractor.h>
+#include <rs_refills/utils/organized_outlier_filter.h>
+#include <rs_refills/utils/shelf_line_map.h>
+#include <rs_refills/utils/stage_profiler.h>
+
+namespace rs_refills
+{
+
+/**
+ * @brief Core of the ShelfDetector annotator, free of ROS, tf and the CAS:
+ *  crops a frame to the current shelf meter, finds shelf lines (NaN
+ *  boundaries of the crop, voxelized, RANSAC) and folds them into the
+ *  shelf layer map of the scan. Input clouds are in the camera frame,
+ *  camToWorld moves them into the frame of the shelf system.
+ */
+class ShelfLineDetector
+{
+public:
+  typedef pcl::PointCloud<pcl::PointXYZRGBA> Cloud;
+
+  enum Stage
+  {
+    STAGE_TRANSFORM_CROP,
+    STAGE_OUTLIERS,
+    STAGE_IMAGE_LINES,
+    STAGE_IMAGE_LIFT,
+    STAGE_EDGE_DETECTION,
+    STAGE_VOXELIZATION,
+    STAGE_RANSAC,
+    STAGE_LINE_MAP
+  };
+
+  enum OutlierFilter
+  {
+    OUTLIER_NONE,
+    OUTLIER_SOR,        //pcl::StatisticalOutlierRemoval, k nearest neighbors from a KdTree
+    OUTLIER_ORGANIZED   //OrganizedOutlierFilter, pixel window of the organized cloud
+  };
+
+  //where the shelf edges of a frame come from
+  enum EdgeSource
+  {
+    EDGES_CLOUD,   //NaN boundaries of the organized cloud, voxelized, RANSAC
+    EDGES_IMAGE    //Hough segments of the masked image, lifted to 3D along the segment
+  };
+
+  struct Parameters
+  {
+    int minLineInliers;
+    int maxLines;          //safety net, extraction stops once no line is left
+    float maxVariance;     //of the inliers on y
+    float maxShelfHeight;  //new layers above this are ignored
+    CropBox shelfMeter;    //in the frame of the shelf system
+    OutlierFilter outlierFilter;   //after cropping
+    OrganizedOutlierFilter::Parameters organizedOutliers;
+    EdgeSource edgeSource;
+    int imageBandRadius;   //pixels above and below an image segment whose points are lifted
+    LineExtractor::Parameters lineExtraction;
+
+    Parameters(): minLineInliers(50), maxLines(10), maxVariance(0.01f), maxShelfHeight(1.85f),
+      //1m shelf, 2 cm closer to the cam up to the deepest shelf, skip the bottom shelf
+      shelfMeter(0.001f, 0.981f, -0.04f, 0.21f, 0.15f, 1.95f),
+      outlierFilter(OUTLIER_SOR), edgeSource(EDGES_CLOUD), imageBandRadius(3)
+    {
+    }
+  };
+
+  //a shelf line of one frame, endpoints in the frame of the shelf system
+  struct LineObservation
+  {
+    Eigen::Vector3f begin, end;
+    float weight;   //number of inliers
+  };
+
+  ShelfLineDetector();
+
+  void setParameters(const Parameters &params);
+
+  const Parameters &getParameters() const
+  {
+    return params_;
+  }
+
+  /**
+   * @brief transform + crop to the shelf meter and remove outliers
+   */
+  void filterCloud(const Cloud &cloud, const Eigen::Affine3f &camToWorld);
+
+  /**
+   * @brief Hough lines in the color image masked with the filtered cloud;
+   *  rgb has to be registered with the cloud
+   */
+  void findLinesInImage(const cv::Mat &rgb);
+
+  /**
+   * @brief NaN boundaries of the filtered cloud into edgeCloud(); findLinesInCloud
+   *  does not extract them
+   * @return false if there were none
+   */
+  bool findEdges();
+
+  /**
+   * @brief shelf lines from the NaN boundaries of the filtered cloud
+   * @return false if there were no boundaries
+   */
+  bool findLinesInCloud();
+
+  /**
+   * @brief shelf lines from the segments of findLinesInImage, without the 3D
+   *  edge detection: the valid points within imageBandRadius pixels of each
+   *  segment are lifted from the filtered cloud, voxelized like the cloud
+   *  edges and checked against the same inlier, variance and angle thresholds
+   *  as the RANSAC lines
+   * @return false if no segment passed; imageLines() tells if there was none at all
+   */
+  bool findLinesFromImage(const cv::Mat &rgb);
+
+  /**
+   * @brief shelf lines of edges that are voxelized already, e.g. the edges of
+   *  all frames of a scan fused into one cloud
+   * @return false if there was no line
+   */
+  bool findLinesInVoxels(const Cloud &voxels);
+
+  /**
+   * @brief endpoints of the lines found by the last findLinesInCloud
+   */
+  void lineObservations(std::vector<LineObservation> &observations) const;
+
+  /**
+   * @brief associate the lines of this frame with the layers of the scan
+   */
+  void updateLineMap();
+
+  /**
+   * @brief same for the lines of any frame and any map, e.g. frames that
+   *  were processed by other detectors; new layers above maxShelfHeight are ignored
+   */
+  static void updateLineMap(ShelfLineMap &lineMap, const std::vector<LineObservation> &observations,
+                            float maxShelfHeight);
+
+  /**
+   * @brief one frame: filterCloud, findLinesInImage (if rgb is not empty),
+   *  findLinesInCloud and updateLineMap; with EDGES_IMAGE and an rgb image
+   *  findLinesFromImage instead of the last two, falling back to
+   *  findLinesInCloud if the image has no segment at all (e.g. bad lighting)
+   */
+  bool process(const Cloud &cloud, const cv::Mat &rgb, const Eigen::Affine3f &camToWorld);
+
+  /**
+   * @brief forget the layers of the scan
+   */
+  void reset()
+  {
+    lineMap_.clear();
+  }
+
+  /**
+   * @brief the frame cropped to the shelf meter, organized
+   */
+  Cloud::Ptr filteredCloud()
+  {
+    return cloudFiltered_;
+  }
+
+  /**
+   * @brief NaN boundaries of the filtered cloud, not organized
+   */
+  Cloud::Ptr edgeCloud()
+  {
+    return edgeCloud_;
+  }
+
+  /**
+   * @brief voxelized NaN boundaries, the line inliers index into this one
+   */
+  Cloud::Ptr lineCloud()
+  {
+    return lineCloud_;
+  }
+
+  /**
+   * @brief points of filteredCloud() in each voxel of lineCloud(), e.g. to
+   *  get from the line inliers back to the pixels; empty for findLinesInVoxels
+   */
+  const HashVoxelGrid::Sources &lineSources() const
+  {
+    return lineSources_;
+  }
+
+  const ValidityMask &validMask() const
+  {
+    return validMask_;
+  }
+
+  /**
+   * @brief valid until the next frame
+   */
+  const std::vector<pcl::PointIndicesPtr> &lineInliers() const
+  {
+    return lineInliers_;
+  }
+
+  const std::vector<Eigen::VectorXf> &lineModels() const
+  {
+    return lineModels_;
+  }
+
+  const std::vector<cv::Vec4i> &imageLines() const
+  {
+    return imageLines_;
+  }
+
+  const cv::Mat &greyImage() const
+  {
+    return grey_;
+  }
+
+  const cv::Mat &binaryImage() const
+  {
+    return bin_;
+  }
+
+  const cv::Mat &edgeImage() const
+  {
+    return edges_;
+  }
+
+  const ShelfLineMap &lineMap() const
+  {
+    return lineMap_;
+  }
+
+  StageProfiler &profiler()
+  {
+    return profiler_;
+  }
+
+  /**
+   * @brief inlier lists created by the frame arena so far, flat in steady state
+   */
+  uint64_t allocations() const
+  {
+    return inlierPool_.allocations();
+  }
+
+private:
+  Parameters params_;
+
+  Cloud::Ptr cloudFiltered_;
+  //edges of cloudFiltered_ and their voxelization
+  Cloud::Ptr edgeCloud_, lineCloud_;
+  HashVoxelGrid voxelGrid_;
+  HashVoxelGrid::Sources lineSources_;
+  //valid (finite and inside the shelf meter) points of cloudFiltered_
+  ValidityMask validMask_;
+
+  //edge detection output, kept between frames so the buffers keep their capacity
+  NanBoundaryExtractor nanBoundary_;
+  pcl::PointIndicesPtr edgeIndices_;
+  std::vector<pcl::PointIndicesPtr> lineInliers_;
+  //frame arena for lineInliers_, reset by findLinesInCloud
+  ObjectPool<pcl::PointIndices> inlierPool_;
+  std::vector<Eigen::VectorXf> lineModels_;
+  std::vector<LineObservation> observations_;
+
+  cv::Mat grey_, bin_, edges_;
+  std::vector<cv::Vec4i> imageLines_;
+  //scratch of findLinesFromImage
+  std::vector<int> liftedPixels_;
+  std::vector<float> heights_;
+  struct ImageLine
+  {
+    pcl::PointIndicesPtr inliers;
+    Eigen::VectorXf model;
+  };
+  std::vector<ImageLine> imageCandidates_;
+
+  LineExtractor lineExtractor_;
+  OrganizedOutlierFilter outlierFilter_;
+  //shelf layers collected during a scan
+  ShelfLineMap lineMap_;
+
+  StageProfiler profiler_;
+
+  //NaN boundaries of cloudFiltered_ into edgeIndices_
+  bool detectEdges();
+  void clearLines();
+  //RANSAC on lineCloud_
+  void extractLines();
+};
+
+}
+
+#endif /* __RS_REFILLS_SHELF_LINE_DETECTOR_H__ */
@@ -0,0 +1,112 @@
+#ifndef __RS_REFILLS_VIEWPOINT_GATE_H__
+#define __RS_REFILLS_VIEWPOINT_GATE_H__
+
+#include <vector>
+#include <stdint.h>
+
+#include <Eigen/Geometry>
+
+#include <rs_refills/utils/camera_intrinsics.h>
+
+namespace rs_refills
+{
+
+/**
+ * @brief Frame selection for a scan: a frame is only worth processing if it
+ *  shows enough shelf that no processed frame of the scan showed from a
+ *  similar viewing direction. The visible region is where the image corners
+ *  hit the front plane of the shelf system (y = shelfPlaneY in its frame),
+ *  as a box in x/z, so no point of the frame has to be touched.
+ */
+class ViewpointGate
+{
+public:
+  struct Parameters
+  {
+    float maxOverlap;    //fraction of the visible region already seen; >= 1 accepts every frame
+    float maxRotation;   //radians between viewing directions to count as the same view
+    float shelfPlaneY;   //front face of the shelf system, ShelfDetector uses the near side of its crop box
+
+    Parameters(): maxOverlap(1.0f), maxRotation(0.1f), shelfPlaneY(0.0f)
+    {
+    }
+  };
+
+  //visible part of the shelf plane
+  struct Region
+  {
+    float minX, maxX, minZ, maxZ;
+
+    float area() const
+    {
+      return (maxX - minX) * (maxZ - minZ);
+    }
+  };
+
+  explicit ViewpointGate(const Parameters &params = Parameters()): params_(params), hasPending_(false),
+    accepted_(0), skipped_(0)
+  {
+  }
+
+  void setParameters(const Parameters &params)
+  {
+    params_ = params;
+  }
+
+  /**
+   * @brief decide on a frame; an accepted frame only counts as seen once it is
+   *  commit()ed, i.e. was processed, a dropped frame leaves its region open
+   * @param camToWorld camera pose in the frame of the shelf system
+   * @return false if the frame is a near duplicate of a processed one
+   */
+  bool wouldAccept(const Eigen::Affine3f &camToWorld, const CameraIntrinsics &intrinsics, int width, int height);
+
+  /**
+   * @brief remember the frame of the last wouldAccept that returned true
+   */
+  void commit();
+
+  /**
+   * @return false if a corner of the image does not hit the plane in front of the camera
+   */
+  static bool visibleRegion(const Eigen::Affine3f &camToWorld, const CameraIntrinsics &intrinsics, int width,
+                            int height, float planeY, Region &region);
+
+  /**
+   * @brief forget the frames of the scan, the counters are kept
+   */
+  void reset()
+  {
+    views_.clear();
+    hasPending_ = false;
+  }
+
+  //committed frames
+  uint64_t accepted() const
+  {
+    return accepted_;
+  }
+
+  uint64_t skipped() const
+  {
+    return skipped_;
+  }
+
+private:
+  struct View
+  {
+    Eigen::Vector3f direction;
+    Region region;
+  };
+
+  Parameters params_;
+  std::vector<View> views_;
+  //accepted by wouldAccept, not committed yet; frames without a region have none
+  View pending_;
+  bool hasPending_;
+  uint64_t accepted_, skipped_;
+};
+
+}
+
+#endif /* __RS_REFILLS_VIEWPOINT_GATE_H__ */
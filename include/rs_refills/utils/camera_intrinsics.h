@@ -0,0 +1,78 @@
+#ifndef __RS_REFILLS_CAMERA_INTRINSICS_H__
+#define __RS_REFILLS_CAMERA_INTRINSICS_H__
+
+#include <limits>
+#include <vector>
+
+#include <Eigen/Core>
+#include <Eigen/StdVector>
+
+namespace rs_refills
+{
+
+/**
+ * @brief Pinhole intrinsics parsed once from the 3x4 projection matrix of a
+ *  sensor_msgs::CameraInfo (row major P). Points are in the camera frame and
+ *  projected without distortion, rotation or the stereo baseline of P, which
+ *  is what decomposeProjectionMatrix + projectPoints with identity pose gave.
+ */
+struct CameraIntrinsics
+{
+  float fx, fy, cx, cy, skew;
+
+  CameraIntrinsics(): fx(0.0f), fy(0.0f), cx(0.0f), cy(0.0f), skew(0.0f)
+  {
+  }
+
+  /**
+   * @param P row major 3x4 projection matrix, the left 3x3 upper triangular
+   *  as in every CameraInfo
+   */
+  explicit CameraIntrinsics(const double *P)
+  {
+    const double s = P[10] != 0.0 ? 1.0 / P[10] : 1.0;
+    fx = P[0] * s;
+    skew = P[1] * s;
+    cx = P[2] * s;
+    fy = P[5] * s;
+    cy = P[6] * s;
+  }
+
+  bool valid() const
+  {
+    return fx != 0.0f && fy != 0.0f;
+  }
+
+  /**
+   * @return false for points behind or on the image plane, u/v are not set then
+   */
+  inline bool project(float x, float y, float z, float &u, float &v) const
+  {
+    if(!(z > 0.0f))
+      return false;
+    const float iz = 1.0f / z;
+    u = (fx * x + skew * y) * iz + cx;
+    v = fy * y * iz + cy;
+    return true;
+  }
+
+  /**
+   * @brief project all points; points that cannot be projected get NaN
+   */
+  void project(const std::vector<Eigen::Vector3f, Eigen::aligned_allocator<Eigen::Vector3f>> &points,
+               std::vector<Eigen::Vector2f, Eigen::aligned_allocator<Eigen::Vector2f>> &pixels) const
+  {
+    pixels.resize(points.size());
+    for(size_t i = 0; i < points.size(); ++i)
+    {
+      const Eigen::Vector3f &p = points[i];
+      Eigen::Vector2f &uv = pixels[i];
+      if(!project(p[0], p[1], p[2], uv[0], uv[1]))
+        uv.setConstant(std::numeric_limits<float>::quiet_NaN());
+    }
+  }
+};
+
+}
+
+#endif /* __RS_REFILLS_CAMERA_INTRINSICS_H__ */
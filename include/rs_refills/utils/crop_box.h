@@ -0,0 +1,63 @@
+#ifndef __RS_REFILLS_CROP_BOX_H__
+#define __RS_REFILLS_CROP_BOX_H__
+
+#include <vector>
+#include <limits>
+
+#include <pcl/point_types.h>
+#include <pcl/point_cloud.h>
+
+namespace rs_refills
+{
+
+/**
+ * @brief Axis aligned box used to crop organized clouds in a single pass.
+ *  Limits are inclusive, same as for pcl::PassThrough; points with a
+ *  non-finite coordinate are never inside.
+ */
+struct CropBox
+{
+  float minX, minY, minZ;
+  float maxX, maxY, maxZ;
+
+  CropBox(): minX(-std::numeric_limits<float>::max()), minY(-std::numeric_limits<float>::max()),
+    minZ(-std::numeric_limits<float>::max()), maxX(std::numeric_limits<float>::max()),
+    maxY(std::numeric_limits<float>::max()), maxZ(std::numeric_limits<float>::max())
+  {
+  }
+
+  CropBox(float minx, float maxx, float miny, float maxy, float minz, float maxz):
+    minX(minx), minY(miny), minZ(minz), maxX(maxx), maxY(maxy), maxZ(maxz)
+  {
+  }
+
+  inline bool contains(float x, float y, float z) const
+  {
+    //written with && so that NaN fails every comparison
+    return x >= minX && x <= maxX && y >= minY && y <= maxY && z >= minZ && z <= maxZ;
+  }
+};
+
+/**
+ * @brief crop the organized cloud in place: every point outside of the box
+ *  gets its coordinates set to NaN, color is kept. Replaces three chained
+ *  pcl::PassThrough calls with setKeepOrganized(true).
+ * @return number of points left inside the box
+ */
+size_t cropOrganized(pcl::PointCloud<pcl::PointXYZRGBA> &cloud, const CropBox &box);
+
+/**
+ * @brief same as above but writes into out; out can be the same object as in
+ */
+size_t cropOrganized(const pcl::PointCloud<pcl::PointXYZRGBA> &in,
+                     pcl::PointCloud<pcl::PointXYZRGBA> &out, const CropBox &box);
+
+/**
+ * @brief collect indices of points inside the box without touching the cloud
+ */
+void cropIndices(const pcl::PointCloud<pcl::PointXYZRGBA> &cloud, const CropBox &box,
+                 std::vector<int> &indices);
+
+}
+
+#endif /* __RS_REFILLS_CROP_BOX_H__ */
@@ -0,0 +1,114 @@
+#ifndef __RS_REFILLS_HASH_VOXEL_GRID_H__
+#define __RS_REFILLS_HASH_VOXEL_GRID_H__
+
+#include <vector>
+#include <cmath>
+#include <stdint.h>
+
+#include <Eigen/Core>
+
+#include <pcl/point_types.h>
+#include <pcl/point_cloud.h>
+
+namespace rs_refills
+{
+
+/**
+ * @brief Voxel downsampling in O(n) with an open addressing hash over the
+ *  voxel keys instead of sorting the points by voxel like pcl::VoxelGrid.
+ *  Works on a subset of the points of a cloud (e.g. the edges of an
+ *  organized cloud), so nothing has to be extracted first, and keeps for
+ *  each voxel the indices of its points in that cloud. Voxels are output in
+ *  the order their first point comes in. The buffers are kept between
+ *  calls, in steady state nothing is allocated. Not thread safe.
+ */
+class HashVoxelGrid
+{
+public:
+  typedef pcl::PointCloud<pcl::PointXYZRGBA> Cloud;
+
+  //points of each voxel, CSR: the points of voxel v are indices[start[v]] .. indices[start[v + 1] - 1]
+  struct Sources
+  {
+    std::vector<int> start, indices;
+
+    Sources(): start(1, 0)
+    {
+    }
+
+    void clear()
+    {
+      start.assign(1, 0);
+      indices.clear();
+    }
+
+    size_t size() const
+    {
+      return start.size() - 1;
+    }
+
+    size_t count(size_t voxel) const
+    {
+      return start[voxel + 1] - start[voxel];
+    }
+
+    const int *begin(size_t voxel) const
+    {
+      return indices.data() + start[voxel];
+    }
+
+    const int *end(size_t voxel) const
+    {
+      return indices.data() + start[voxel + 1];
+    }
+  };
+
+  explicit HashVoxelGrid(float leafSize = 0.02f): leafSize_(leafSize)
+  {
+  }
+
+  void setLeafSize(float leafSize)
+  {
+    leafSize_ = leafSize;
+  }
+
+  float getLeafSize() const
+  {
+    return leafSize_;
+  }
+
+  /**
+   * @brief centroids of the voxels of the points indices of cloud, appended
+   *  to voxels with the color of their first point; their points are
+   *  appended to sources, which has to describe voxels so far
+   * @param indices finite points of cloud
+   */
+  void voxelize(const Cloud &cloud, const std::vector<int> &indices, Cloud &voxels, Sources &sources);
+
+  /**
+   * @brief 21 bits per axis, a few hundred meters at 2 cm before keys repeat
+   */
+  static uint64_t key(const Eigen::Vector3f &p, float leafSize)
+  {
+    const uint64_t mask = (1u << 21) - 1;
+    const float inv = 1.0f / leafSize;
+    const uint64_t x = static_cast<int64_t>(std::floor(p.x() * inv)) & mask;
+    const uint64_t y = static_cast<int64_t>(std::floor(p.y() * inv)) & mask;
+    const uint64_t z = static_cast<int64_t>(std::floor(p.z() * inv)) & mask;
+    return x | (y << 21) | (z << 42);
+  }
+
+private:
+  float leafSize_;
+
+  //hash table, a power of two of at least twice the number of points; -1 is empty
+  std::vector<uint64_t> keys_;
+  std::vector<int> slots_;
+  //voxel of each input point, points and sum per voxel
+  std::vector<int> pointVoxel_, counts_;
+  std::vector<Eigen::Vector3f> sums_;
+};
+
+}
+
+#endif /* __RS_REFILLS_HASH_VOXEL_GRID_H__ */
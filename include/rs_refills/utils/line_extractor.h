@@ -0,0 +1,114 @@
+#ifndef __RS_REFILLS_LINE_EXTRACTOR_H__
+#define __RS_REFILLS_LINE_EXTRACTOR_H__
+
+#include <vector>
+#include <random>
+#include <cmath>
+#include <stdint.h>
+
+#include <Eigen/Core>
+
+#include <pcl/point_types.h>
+#include <pcl/point_cloud.h>
+
+namespace rs_refills
+{
+
+/**
+ * @brief RANSAC for lines parallel to the x axis in the XZ plane (y of the
+ *  points is ignored, i.e. they are treated as projected onto the XZ plane).
+ *  A 2D grid over x/z is built once per cloud and used to draw the second
+ *  sample close to the first one (same as setSamplesMaxDist with a KdTree).
+ *  Points belonging to an extracted line are masked out, nothing is copied,
+ *  so the same index serves every line found in the frame.
+ *
+ *  Each round draws a batch of hypotheses from a seeded generator, scores
+ *  them in parallel (OpenMP) and accepts every non overlapping line with
+ *  enough inliers, so a shelf with many layers needs only a few rounds.
+ *  The generator is reseeded in setInputCloud: same cloud, same lines.
+ */
+class LineExtractor
+{
+public:
+  struct Parameters
+  {
+    float sampleMaxDist;     //max distance between the two samples of a hypothesis
+    float epsAngle;          //max angle to the x axis [rad]
+    float distanceThreshold; //max distance of an inlier to the line
+    int hypothesesPerRound;
+    unsigned int seed;
+
+    Parameters(): sampleMaxDist(0.07f), epsAngle(1.5f * M_PI / 180.0f), distanceThreshold(0.01f),
+      hypothesesPerRound(500), seed(42)
+    {
+    }
+  };
+
+  LineExtractor();
+
+  void setParameters(const Parameters &params)
+  {
+    params_ = params;
+  }
+
+  const Parameters &getParameters() const
+  {
+    return params_;
+  }
+
+  /**
+   * @brief builds the grid over the finite points of cloud; the cloud must
+   *  stay alive and unchanged while lines are extracted
+   */
+  void setInputCloud(const pcl::PointCloud<pcl::PointXYZRGBA> &cloud);
+
+  /**
+   * @brief one round: all non overlapping lines with at least minInliers
+   *  inliers among the points that were not removed yet, best first
+   * @param inliers per line, indices into the input cloud
+   * @param coefficients per line: point on line and direction, same as pcl::SACMODEL_LINE
+   * @return number of lines found
+   */
+  size_t findLines(std::vector<std::vector<int>> &inliers, std::vector<Eigen::VectorXf> &coefficients,
+                   size_t minInliers);
+
+  /**
+   * @brief mask points out of all further searches
+   */
+  void removePoints(const std::vector<int> &indices);
+
+  inline size_t remaining() const
+  {
+    return active_.size();
+  }
+
+private:
+  Parameters params_;
+  const pcl::PointCloud<pcl::PointXYZRGBA> *cloud_;
+
+  //grid over x/z in cells of sampleMaxDist, points stored per cell (CSR)
+  float minX_, minZ_, cellSize_;
+  int cellsX_, cellsZ_;
+  std::vector<int> cellStart_, cellPoints_, pointCell_;
+
+  std::vector<int> active_;
+  std::vector<uint8_t> isActive_;
+  std::vector<uint8_t> taken_;
+  std::vector<int> candidates_;
+
+  struct Hypothesis
+  {
+    Eigen::Vector2f point, dir;
+    size_t score;
+  };
+  std::vector<Hypothesis> hypotheses_;
+
+  std::mt19937 rng_;
+
+  bool drawHypothesis(Eigen::Vector2f &point, Eigen::Vector2f &dir);
+  size_t countInliers(const Eigen::Vector2f &point, const Eigen::Vector2f &dir, std::vector<int> *inliers) const;
+};
+
+}
+
+#endif /* __RS_REFILLS_LINE_EXTRACTOR_H__ */
@@ -0,0 +1,44 @@
+#ifndef __RS_REFILLS_NAN_BOUNDARY_H__
+#define __RS_REFILLS_NAN_BOUNDARY_H__
+
+#include <vector>
+#include <stdint.h>
+
+#include <rs_refills/utils/organized_transform.h>
+
+namespace rs_refills
+{
+
+/**
+ * @brief NaN boundaries of an organized cloud from its ValidityMask alone:
+ *  valid points that have an invalid point among their 8 neighbors. Same as
+ *  EDGELABEL_NAN_BOUNDARY of pcl::OrganizedEdgeFromNormals with no search
+ *  along the boundary (max search neighbors 0), the outermost rows and
+ *  columns of the image are never boundaries. The mask is copied into
+ *  row aligned words once, a row of boundaries is then a few shifts and
+ *  ANDs per 64 pixels; rows run in parallel (OpenMP). No normals, no point
+ *  is touched. Buffers are kept between calls.
+ */
+class NanBoundaryExtractor
+{
+public:
+  /**
+   * @param boundary indices of the boundary points, in row major order
+   * @return number of boundary points
+   */
+  size_t extract(const ValidityMask &valid, int width, int height, std::vector<int> &boundary);
+
+private:
+  int rowWords_;
+  //valid and boundary bits, rowWords_ per row, bit u of a row is column u
+  std::vector<uint64_t> rows_, boundaryBits_;
+  //first index in the output per row
+  std::vector<int> rowStart_;
+
+  void copyRow(const ValidityMask &valid, int width, int v);
+  void boundaryRow(int width, int v);
+};
+
+}
+
+#endif /* __RS_REFILLS_NAN_BOUNDARY_H__ */
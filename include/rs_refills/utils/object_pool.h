@@ -0,0 +1,70 @@
+#ifndef __RS_REFILLS_OBJECT_POOL_H__
+#define __RS_REFILLS_OBJECT_POOL_H__
+
+#include <vector>
+#include <stdint.h>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/make_shared.hpp>
+
+namespace rs_refills
+{
+
+/**
+ * @brief frame arena for objects that are handed out as shared pointers,
+ *  e.g. pcl::PointIndices. Objects are only created while the pool grows,
+ *  reset() makes all of them available again and keeps their state, so
+ *  buffers inside them keep their capacity; callers overwrite what they get.
+ *  Objects handed out are valid until the next reset(), holding on to one
+ *  longer sees it being reused. Not thread safe.
+ */
+template<typename T>
+class ObjectPool
+{
+public:
+  ObjectPool(): used_(0), allocations_(0)
+  {
+  }
+
+  boost::shared_ptr<T> acquire()
+  {
+    if(used_ == objects_.size())
+    {
+      objects_.push_back(boost::make_shared<T>());
+      ++allocations_;
+    }
+    return objects_[used_++];
+  }
+
+  void reset()
+  {
+    used_ = 0;
+  }
+
+  size_t used() const
+  {
+    return used_;
+  }
+
+  size_t size() const
+  {
+    return objects_.size();
+  }
+
+  /**
+   * @brief number of objects created so far; flat once the pool is warm
+   */
+  uint64_t allocations() const
+  {
+    return allocations_;
+  }
+
+private:
+  std::vector<boost::shared_ptr<T>> objects_;
+  size_t used_;
+  uint64_t allocations_;
+};
+
+}
+
+#endif /* __RS_REFILLS_OBJECT_POOL_H__ */
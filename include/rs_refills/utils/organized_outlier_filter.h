@@ -0,0 +1,69 @@
+#ifndef __RS_REFILLS_ORGANIZED_OUTLIER_FILTER_H__
+#define __RS_REFILLS_ORGANIZED_OUTLIER_FILTER_H__
+
+#include <vector>
+
+#include <pcl/point_types.h>
+#include <pcl/point_cloud.h>
+
+#include <rs_refills/utils/organized_transform.h>
+
+namespace rs_refills
+{
+
+/**
+ * @brief Statistical outlier removal on the image grid of an organized
+ *  cloud: the neighbors of a point are the meanK closest of the valid points
+ *  in a fixed pixel window around it instead of its k nearest neighbors in
+ *  the whole cloud, so there is no KdTree and no search; a depth outlier in
+ *  the window does not count for the points around it. Same statistic as
+ *  pcl::StatisticalOutlierRemoval:
+ *  a point is removed if its mean distance to the neighbors is above
+ *  mean + stddevMul * stddev of that distance over all points; points
+ *  without a valid neighbor are removed as well. Rows are processed in
+ *  parallel (OpenMP), the cloud stays organized.
+ */
+class OrganizedOutlierFilter
+{
+public:
+  struct Parameters
+  {
+    int windowRadius;   //window of (2r+1)^2 pixels, 2 gives up to 24 candidates
+    int meanK;          //closest candidates averaged
+    float stddevMul;
+
+    Parameters(): windowRadius(2), meanK(8), stddevMul(0.5f)
+    {
+    }
+  };
+
+  OrganizedOutlierFilter()
+  {
+  }
+
+  void setParameters(const Parameters &params)
+  {
+    params_ = params;
+  }
+
+  const Parameters &getParameters() const
+  {
+    return params_;
+  }
+
+  /**
+   * @brief removed points get NaN coordinates and their bit in valid reset
+   * @param valid valid points of cloud, only these are looked at
+   * @return number of points removed
+   */
+  size_t filter(pcl::PointCloud<pcl::PointXYZRGBA> &cloud, ValidityMask &valid);
+
+private:
+  Parameters params_;
+  //mean distance to the neighbors per point, reused between frames
+  std::vector<float> meanDistances_;
+};
+
+}
+
+#endif /* __RS_REFILLS_ORGANIZED_OUTLIER_FILTER_H__ */
@@ -0,0 +1,161 @@
+#ifndef __RS_REFILLS_ORGANIZED_TRANSFORM_H__
+#define __RS_REFILLS_ORGANIZED_TRANSFORM_H__
+
+#include <vector>
+#include <stdint.h>
+
+#include <Eigen/Geometry>
+
+#include <pcl/point_types.h>
+#include <pcl/point_cloud.h>
+
+#include <rs_refills/utils/crop_box.h>
+
+namespace rs_refills
+{
+
+/**
+ * @brief one bit per point of an organized cloud, set if the point is valid
+ *  (finite and inside the crop box). Lets later stages skip the per pixel
+ *  pcl::isFinite checks.
+ */
+class ValidityMask
+{
+  std::vector<uint64_t> words_;
+  size_t size_;
+
+public:
+  ValidityMask(): size_(0)
+  {
+  }
+
+  void resize(size_t size)
+  {
+    size_ = size;
+    words_.assign((size + 63) / 64, 0);
+  }
+
+  inline size_t size() const
+  {
+    return size_;
+  }
+
+  inline bool test(size_t i) const
+  {
+    return (words_[i >> 6] >> (i & 63)) & 1u;
+  }
+
+  inline void set(size_t i)
+  {
+    words_[i >> 6] |= uint64_t(1) << (i & 63);
+  }
+
+  inline void reset(size_t i)
+  {
+    words_[i >> 6] &= ~(uint64_t(1) << (i & 63));
+  }
+
+  inline uint64_t *words()
+  {
+    return words_.data();
+  }
+
+  inline const uint64_t *words() const
+  {
+    return words_.data();
+  }
+
+  inline size_t numWords() const
+  {
+    return words_.size();
+  }
+
+  size_t count() const
+  {
+    size_t c = 0;
+    for(uint64_t w : words_)
+      c += __builtin_popcountll(w);
+    return c;
+  }
+
+  /**
+   * @brief call f(index) for every valid point, in order
+   */
+  template<typename F>
+  void forEachValid(F f) const
+  {
+    for(size_t w = 0; w < words_.size(); ++w)
+    {
+      uint64_t bits = words_[w];
+      while(bits)
+      {
+        f(w * 64 + __builtin_ctzll(bits));
+        bits &= bits - 1;
+      }
+    }
+  }
+
+  /**
+   * @brief call f(index) for every point that is NOT valid
+   */
+  template<typename F>
+  void forEachInvalid(F f) const
+  {
+    for(size_t w = 0; w < words_.size(); ++w)
+    {
+      uint64_t inv = ~words_[w];
+      if(w == words_.size() - 1 && (size_ & 63))
+        inv &= (uint64_t(1) << (size_ & 63)) - 1;
+      while(inv)
+      {
+        f(w * 64 + __builtin_ctzll(inv));
+        inv &= inv - 1;
+      }
+    }
+  }
+};
+
+enum class SimdLevel
+{
+  AUTO,
+  SCALAR,
+  SSE,
+  AVX2
+};
+
+/**
+ * @brief best kernel the CPU we run on supports; checked once
+ */
+SimdLevel detectSimdLevel();
+
+const char *simdLevelName(SimdLevel level);
+
+/**
+ * @brief transform and crop in one sweep: each point of in is moved into the
+ *  box frame with transform and only written to out (organized, same size as
+ *  in) if it ends up inside the box, otherwise out gets NaN coordinates.
+ *  Replaces pcl::transformPointCloud on the full cloud followed by a crop.
+ *  The kernel is picked at runtime (AVX2/FMA, SSE or scalar) unless level
+ *  forces one. out can be the same object as in.
+ * @param mask filled with the points that ended up in the box
+ * @return number of points left inside the box
+ */
+size_t transformAndCrop(const pcl::PointCloud<pcl::PointXYZRGBA> &in,
+                        pcl::PointCloud<pcl::PointXYZRGBA> &out,
+                        const Eigen::Affine3f &transform, const CropBox &box,
+                        ValidityMask &mask, SimdLevel level = SimdLevel::AUTO);
+
+size_t transformAndCrop(const pcl::PointCloud<pcl::PointXYZRGBA> &in,
+                        pcl::PointCloud<pcl::PointXYZRGBA> &out,
+                        const Eigen::Affine3f &transform, const CropBox &box);
+
+/**
+ * @brief plain organized transform with NaN propagation and validity mask
+ */
+size_t transformOrganized(const pcl::PointCloud<pcl::PointXYZRGBA> &in,
+                          pcl::PointCloud<pcl::PointXYZRGBA> &out,
+                          const Eigen::Affine3f &transform, ValidityMask &mask);
+
+}
+
+#endif /* __RS_REFILLS_ORGANIZED_TRANSFORM_H__ */
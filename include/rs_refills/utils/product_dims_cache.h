@@ -0,0 +1,101 @@
+#ifndef __RS_REFILLS_PRODUCT_DIMS_CACHE_H__
+#define __RS_REFILLS_PRODUCT_DIMS_CACHE_H__
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <stdint.h>
+
+namespace rs_refills
+{
+
+struct ProductDims
+{
+  double height, width, depth;
+
+  ProductDims(): height(0.0), width(0.0), depth(0.0)
+  {
+  }
+
+  ProductDims(double h, double w, double d): height(h), width(w), depth(d)
+  {
+  }
+};
+
+/**
+ * @brief in-process cache of product dimensions keyed by product class, in
+ *  front of the knowledge base. Entries carry the wall clock time they were
+ *  fetched at, so an optional TTL also holds across restarts when the cache
+ *  is persisted with save() and load(). All methods are thread safe.
+ *
+ *  File format, one product per line: "class height width depth [stamp]",
+ *  stamp in seconds since epoch; entries without one count as fetched at
+ *  load time (hand written preload files).
+ */
+class ProductDimsCache
+{
+public:
+  /**
+   * @param ttl seconds an entry stays valid, <= 0 never expires
+   */
+  explicit ProductDimsCache(double ttl = 0.0);
+
+  void setTTL(double ttl)
+  {
+    ttl_ = ttl;
+  }
+
+  /**
+   * @return true and the dims if the class is cached and not expired
+   */
+  bool lookup(const std::string &product, ProductDims &dims);
+
+  void insert(const std::string &product, const ProductDims &dims);
+
+  /**
+   * @brief add the entries of a file, existing entries are overwritten
+   * @return number of entries read, -1 if the file could not be opened
+   */
+  int load(const std::string &file);
+
+  bool save(const std::string &file) const;
+
+  size_t size() const;
+
+  void clear();
+
+  uint64_t hits() const
+  {
+    return hits_.load(std::memory_order_relaxed);
+  }
+
+  uint64_t misses() const
+  {
+    return misses_.load(std::memory_order_relaxed);
+  }
+
+  /**
+   * @brief cache key of a product class: the name after the namespace,
+   *  so shop:'X' and 'http://.../shop.owl#X' share an entry
+   */
+  static std::string key(const std::string &product);
+
+private:
+  struct Entry
+  {
+    ProductDims dims;
+    int64_t stamp;
+  };
+
+  double ttl_;
+  mutable std::mutex mutex_;
+  std::unordered_map<std::string, Entry> entries_;
+  std::atomic<uint64_t> hits_, misses_;
+
+  static int64_t now();
+};
+
+}
+
+#endif /* __RS_REFILLS_PRODUCT_DIMS_CACHE_H__ */
@@ -0,0 +1,108 @@
+#ifndef __RS_REFILLS_SHELF_LINE_MAP_H__
+#define __RS_REFILLS_SHELF_LINE_MAP_H__
+
+#include <vector>
+#include <utility>
+
+#include <Eigen/Core>
+
+namespace rs_refills
+{
+
+/**
+ * @brief weighted running mean and variance (West's incremental algorithm)
+ */
+struct RunningPoint
+{
+  Eigen::Vector3f mean;
+  Eigen::Vector3f m2;
+  float weight;
+  int count;
+
+  RunningPoint(): mean(Eigen::Vector3f::Zero()), m2(Eigen::Vector3f::Zero()), weight(0.0f), count(0)
+  {
+  }
+
+  void add(const Eigen::Vector3f &pt, float w)
+  {
+    weight += w;
+    ++count;
+    const Eigen::Vector3f delta = pt - mean;
+    mean += delta * (w / weight);
+    m2 += w * delta.cwiseProduct(pt - mean);
+  }
+
+  Eigen::Vector3f variance() const
+  {
+    return weight > 0.0f ? Eigen::Vector3f(m2 / weight) : Eigen::Vector3f::Zero();
+  }
+};
+
+/**
+ * @brief shelf layers (lines) collected over the frames of a scan. Layers
+ *  are kept sorted by the height of their begin point, so associating an
+ *  observation is a binary search plus a look at the layers in the match
+ *  radius, and each endpoint keeps weighted running statistics instead of
+ *  being pulled halfway towards the newest observation.
+ */
+class ShelfLineMap
+{
+public:
+  struct Layer
+  {
+    int id;
+    RunningPoint begin, end;
+  };
+
+  /**
+   * @param matchDistance max distance in the y/z plane of both endpoints
+   *  for an observation to belong to a layer
+   */
+  explicit ShelfLineMap(float matchDistance = 0.1f): matchDistance_(matchDistance)
+  {
+  }
+
+  /**
+   * @return id of the layer matching the line, -1 if there is none
+   */
+  int find(const Eigen::Vector3f &begin, const Eigen::Vector3f &end) const;
+
+  /**
+   * @brief fold an observation into layer id, weight is e.g. the number of inliers
+   */
+  void update(int id, const Eigen::Vector3f &begin, const Eigen::Vector3f &end, float weight);
+
+  /**
+   * @return id of the new layer
+   */
+  int insert(const Eigen::Vector3f &begin, const Eigen::Vector3f &end, float weight);
+
+  const std::vector<Layer> &layers() const
+  {
+    return layers_;
+  }
+
+  size_t size() const
+  {
+    return layers_.size();
+  }
+
+  void clear()
+  {
+    layers_.clear();
+    byHeight_.clear();
+  }
+
+private:
+  float matchDistance_;
+  //ids are indices in layers_
+  std::vector<Layer> layers_;
+  //(height of begin point, id), sorted
+  std::vector<std::pair<float, int>> byHeight_;
+
+  void reindex(int id, float oldHeight);
+};
+
+}
+
+#endif /* __RS_REFILLS_SHELF_LINE_MAP_H__ */
@@ -0,0 +1,149 @@
+#ifndef __RS_REFILLS_STAGE_PROFILER_H__
+#define __RS_REFILLS_STAGE_PROFILER_H__
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+namespace rs_refills
+{
+
+/**
+ * @brief lock-free latency histogram in microseconds. Buckets are log2 with
+ *  8 linear sub-buckets (~12% resolution), recording is a relaxed atomic
+ *  increment so it can be called from any thread.
+ */
+class LatencyHistogram
+{
+public:
+  static const size_t NUM_BUCKETS = 320;
+
+  LatencyHistogram();
+
+  void record(uint64_t microseconds);
+
+  uint64_t count() const
+  {
+    return count_.load(std::memory_order_relaxed);
+  }
+
+  double mean() const;
+
+  uint64_t max() const
+  {
+    return max_.load(std::memory_order_relaxed);
+  }
+
+  /**
+   * @param p in [0, 1], e.g. 0.99
+   * @return upper bound of the bucket holding the p-th quantile
+   */
+  uint64_t percentile(double p) const;
+
+  /**
+   * @brief add the samples of other, e.g. of a stage timed on another thread
+   */
+  void merge(const LatencyHistogram &other);
+
+  void reset();
+
+private:
+  std::vector<std::atomic<uint64_t>> buckets_;
+  std::atomic<uint64_t> count_, sum_, max_;
+
+  static size_t bucketOf(uint64_t value);
+  static uint64_t bucketUpperBound(size_t bucket);
+};
+
+/**
+ * @brief one LatencyHistogram per named stage of an annotator
+ */
+class StageProfiler
+{
+public:
+  explicit StageProfiler(const std::vector<std::string> &stageNames);
+
+  void record(size_t stage, uint64_t microseconds)
+  {
+    histograms_[stage]->record(microseconds);
+  }
+
+  const std::string &name(size_t stage) const
+  {
+    return names_[stage];
+  }
+
+  const LatencyHistogram &histogram(size_t stage) const
+  {
+    return *histograms_[stage];
+  }
+
+  size_t numStages() const
+  {
+    return names_.size();
+  }
+
+  /**
+   * @brief table with count, mean, p50, p95, p99 and max per stage [ms]
+   */
+  std::string report() const;
+
+  bool writeReport(const std::string &file) const;
+
+  /**
+   * @brief reports of several profilers (e.g. annotator and its core) in one file
+   */
+  static bool writeReports(const std::string &file, const std::vector<const StageProfiler *> &profilers);
+
+  /**
+   * @brief add the samples of a profiler with the same stages, e.g. of
+   *  another instance of the same annotator core
+   */
+  void merge(const StageProfiler &other);
+
+  void reset();
+
+private:
+  std::vector<std::string> names_;
+  std::vector<std::unique_ptr<LatencyHistogram>> histograms_;
+};
+
+/**
+ * @brief records the lifetime of the object (or until stop()) into a stage
+ *  of a profiler
+ */
+class ScopedStageTimer
+{
+public:
+  ScopedStageTimer(StageProfiler &profiler, size_t stage): profiler_(profiler), stage_(stage),
+    start_(std::chrono::steady_clock::now()), running_(true)
+  {
+  }
+
+  ~ScopedStageTimer()
+  {
+    stop();
+  }
+
+  void stop()
+  {
+    if(!running_)
+      return;
+    running_ = false;
+    profiler_.record(stage_, std::chrono::duration_cast<std::chrono::microseconds>(
+                       std::chrono::steady_clock::now() - start_).count());
+  }
+
+private:
+  StageProfiler &profiler_;
+  size_t stage_;
+  std::chrono::steady_clock::time_point start_;
+  bool running_;
+};
+
+}
+
+#endif /* __RS_REFILLS_STAGE_PROFILER_H__ */
@@ -35,9 +35,18 @@
 #include <rapidjson/rapidjson.h>
 #include <rapidjson/document.h>
 
+#include <future>
+#include <map>
+#include <memory>
+
 //json_prolog
 #include <json_prolog/prolog.h>
 
+#include <rs_refills/core/facing_counter.h>
+#include <rs_refills/utils/camera_intrinsics.h>
+#include <rs_refills/utils/product_dims_cache.h>
+#include <rs_refills/utils/stage_profiler.h>
+
 using namespace uima;
 
 
@@ -47,36 +56,77 @@ private:
   bool external_, useLocalFrame_;
   tf::StampedTransform camToWorld_;
 
-  pcl::PointCloud<pcl::PointXYZRGBA>::Ptr cloudFiltered_;
   pcl::PointCloud<pcl::PointXYZRGBA>::Ptr cloud_ptr_;
-  std::vector<pcl::PointIndices> cluster_indices_;
-
-  cv::Mat rgb_;
-  std::string localFrameName_;
+  //normals of the frame, reused between frames
+  pcl::PointCloud<pcl::Normal>::Ptr normals_;
 
-  struct BoundingBox
+  //one facing of a detect query; a batch query ("facings" array) has several
+  struct Facing
   {
-    pcl::PointXYZ minPt, maxPt;
+    std::string obj, shelfType;
+    float distToNextSep;
+    tf::Stamped<tf::Pose> separatorPose, separatorPoseInImage, nextSeparatorPoseInImage;
+    rs_refills::ProductDims dims;
   };
+  std::vector<Facing> facings_;
+
+  //cropping to the facing and clustering, one counter per facing so that
+  //the facings of a batch can be counted in parallel on the same frame
+  std::vector<std::unique_ptr<rs_refills::FacingCounter>> counters_;
+  rs_refills::StageProfiler counterProfiler_;
+
+  //the frame in the shelf frame, shared by the facings of a batch
+  pcl::PointCloud<pcl::PointXYZRGBA>::Ptr shelfCloud_;
+  rs_refills::ValidityMask shelfMask_;
+
+  cv::Mat rgb_;
+  std::string localFrameName_;
 
 
   tf::TransformListener *listener;
-  std::vector<BoundingBox> cluster_boxes;
   ros::NodeHandle nodeHandle_;
 
   image_transport::Publisher image_pub_;
+  //the debug image is drawn on demand, for subscribers of image_pub_ or the visualizer
+  bool imageDrawn_;
   image_transport::ImageTransport it_;
 
-  tf::Stamped<tf::Pose> separatorPoseInImage_, nextSeparatorPoseInImage_;
-
   sensor_msgs::CameraInfo camInfo_;
+  //parsed from camInfo_.P whenever that changes
+  rs_refills::CameraIntrinsics intrinsics_;
+  sensor_msgs::CameraInfo::_P_type intrinsicsP_;
+  //scratch of drawOnImage
+  std::vector<Eigen::Vector3f, Eigen::aligned_allocator<Eigen::Vector3f>> separatorPoints_;
+  std::vector<Eigen::Vector2f, Eigen::aligned_allocator<Eigen::Vector2f>> separatorPixels_;
+
+  //per stage latencies of the annotator itself, the algorithm stages are
+  //profiled by the counters; both are reported on destroy
+  enum Stage
+  {
+    STAGE_TOTAL,
+    STAGE_PROLOG_LOOKUP,
+    STAGE_DIMS_WAIT,
+    STAGE_CAS_READ,
+    STAGE_TF_LOOKUP,
+    STAGE_CAS_WRITE,
+    STAGE_DRAWING
+  };
+  rs_refills::StageProfiler profiler_;
+  std::string latencyReportFile_;
+
+  //product dimensions already asked from the knowledge base
+  rs_refills::ProductDimsCache dimsCache_;
+  std::string dimsCacheFile_;
 
 public:
 
-  ProductCounter(): DrawingAnnotator(__func__), useLocalFrame_(false), nodeHandle_("~"), it_(nodeHandle_)
+  ProductCounter(): DrawingAnnotator(__func__), useLocalFrame_(false), counterProfiler_({"transform_crop", "refine_crop", "clustering"}),
+    nodeHandle_("~"), imageDrawn_(false), it_(nodeHandle_),
+    profiler_({"total", "prolog_lookup", "dims_wait", "cas_read", "tf_lookup", "cas_write", "drawing"})
   {
-    cloudFiltered_ = boost::make_shared<pcl::PointCloud<pcl::PointXYZRGBA>>();
     cloud_ptr_ = boost::make_shared<pcl::PointCloud<pcl::PointXYZRGBA>>();
+    shelfCloud_ = boost::make_shared<pcl::PointCloud<pcl::PointXYZRGBA>>();
+    normals_ = boost::make_shared<pcl::PointCloud<pcl::Normal>>();
 
     listener = new tf::TransformListener(nodeHandle_, ros::Duration(10.0));
 
@@ -89,12 +139,45 @@ public:
     ctx.extractValue("external", external_);
 
     ctx.extractValue("use_local_frame", useLocalFrame_);
+    if(ctx.isParameterDefined("latency_report"))
+      ctx.extractValue("latency_report", latencyReportFile_);
+
+    if(ctx.isParameterDefined("dims_cache_ttl"))
+    {
+      float ttl;
+      ctx.extractValue("dims_cache_ttl", ttl);
+      dimsCache_.setTTL(ttl);
+    }
+    if(ctx.isParameterDefined("dims_cache_file"))
+    {
+      ctx.extractValue("dims_cache_file", dimsCacheFile_);
+      int loaded = dimsCache_.load(dimsCacheFile_);
+      if(loaded >= 0)
+        outInfo("Loaded dimensions of " << loaded << " products from " << dimsCacheFile_);
+    }
+    bool preloadDims = false;
+    if(ctx.isParameterDefined("dims_preload"))
+      ctx.extractValue("dims_preload", preloadDims);
+    if(preloadDims)
+      preloadObjectDims();
     return UIMA_ERR_NONE;
   }
 
   TyErrorId destroy()
   {
     outInfo("destroy");
+    outInfo("Stage latencies:" << std::endl << profiler_.report() << counterProfiler_.report());
+    if(!latencyReportFile_.empty() &&
+       !rs_refills::StageProfiler::writeReports(latencyReportFile_, {&profiler_, &counterProfiler_}))
+      outWarn("Could not write latency report to " << latencyReportFile_);
+    outInfo("Dimension cache: " << dimsCache_.size() << " products, " << dimsCache_.hits() << " hits, "
+            << dimsCache_.misses() << " misses");
+    uint64_t allocations = 0;
+    for(const auto &counter : counters_)
+      allocations += counter->allocations();
+    outInfo("Cluster index lists allocated: " << allocations);
+    if(!dimsCacheFile_.empty() && !dimsCache_.save(dimsCacheFile_))
+      outWarn("Could not write dimension cache to " << dimsCacheFile_);
     return UIMA_ERR_NONE;
   }
 
@@ -103,7 +186,35 @@ public:
     outWarn("Not yet implemented");
   }
 
-  bool handleQuery(CAS &tcas, std::string &obj, tf::Stamped<tf::Pose> &pose, std::string &shelf_type, float &distToNextSep)
+  /**
+   * @brief read the fields of a facing that are present in v
+   * @return false if v has no separator pose
+   */
+  bool readFacing(const rapidjson::Value &v, Facing &facing)
+  {
+    if(v.HasMember("type")) facing.obj = v["type"].GetString();
+    if(v.HasMember("shelf_type")) facing.shelfType = v["shelf_type"].GetString();
+    if(v.HasMember("width")) facing.distToNextSep = v["width"].GetFloat();
+    if(!v.HasMember("pose_stamped"))
+      return false;
+
+    tf::Vector3 position;
+    position.setX(v["pose_stamped"]["pose"]["position"]["x"].GetFloat());
+    position.setY(v["pose_stamped"]["pose"]["position"]["y"].GetFloat());
+    position.setZ(v["pose_stamped"]["pose"]["position"]["z"].GetFloat());
+    facing.separatorPose.frame_id_ = v["pose_stamped"]["header"]["frame_id"].GetString();
+    facing.separatorPose.setOrigin(position);
+    facing.separatorPose.setRotation(tf::Quaternion(0, 0, 0, 1));
+    //            pose.stamp_ = ros::Time::now();
+    return true;
+  }
+
+  /**
+   * @brief a detect query describes one facing; with a "facings" array it
+   *  describes all facings of a layer, each inheriting type, shelf_type and
+   *  width of the query unless it sets them itself
+   */
+  bool handleQuery(CAS &tcas, std::vector<Facing> &facings)
   {
     rs::SceneCas cas(tcas);
     rs::Query query = rs::create<rs::Query>(tcas);
@@ -118,35 +229,33 @@ public:
         {
           rapidjson::Value &dQuery = doc["detect"];
 
-          if(dQuery.HasMember("type"))
-          {
-            obj = dQuery["type"].GetString();
-          }
-          if(dQuery.HasMember("pose_stamped"))
-          {
-
-            tf::Vector3 position;
-            position.setX(dQuery["pose_stamped"]["pose"]["position"]["x"].GetFloat());
-            position.setY(dQuery["pose_stamped"]["pose"]["position"]["y"].GetFloat());
-            position.setZ(dQuery["pose_stamped"]["pose"]["position"]["z"].GetFloat());
-            pose.frame_id_ = dQuery["pose_stamped"]["header"]["frame_id"].GetString();
-            pose.setOrigin(position);
-            pose.setRotation(tf::Quaternion(0, 0, 0, 1));
-            //            pose.stamp_ = ros::Time::now();
-          }
-          else
-            return false;
           if(useLocalFrame_)
           {
             if(!dQuery.HasMember("location")) return false;
             localFrameName_ = dQuery["location"].GetString();
           }
 
-          if(dQuery.HasMember("shelf_type")) shelf_type = dQuery["shelf_type"].GetString();
-          else shelf_type = "standing";
+          Facing facing;
+          facing.shelfType = "standing";
+          facing.distToNextSep = 0.0;
+          bool hasPose = readFacing(dQuery, facing);
 
-          if(dQuery.HasMember("width")) distToNextSep = dQuery["width"].GetFloat();
-          else distToNextSep = 0.0;
+          if(dQuery.HasMember("facings") && dQuery["facings"].IsArray())
+          {
+            const rapidjson::Value &batch = dQuery["facings"];
+            for(rapidjson::SizeType i = 0; i < batch.Size(); ++i)
+            {
+              Facing f = facing;
+              if(readFacing(batch[i], f))
+                facings.push_back(f);
+              else
+                outWarn("Facing " << i << " has no pose_stamped, skipping it");
+            }
+            return !facings.empty();
+          }
+          else if(!hasPose)
+            return false;
+          facings.push_back(facing);
         }
         else
           return false;
@@ -156,8 +265,58 @@ public:
     return false;
   }
 
+  /**
+   * @brief fill the dimension cache with every product class of the
+   *  knowledge base in a single query
+   */
+  void preloadObjectDims()
+  {
+    std::stringstream plQuery;
+    plQuery << "owl_subclass_of(C,shop:'Product'),"
+            << "owl_class_properties(C,shop:depthOfProduct,literal(type(_,D_XSD))),atom_number(D_XSD,D),"
+            << "owl_class_properties(C,shop:widthOfProduct,literal(type(_,W_XSD))),atom_number(W_XSD,W),"
+            << "owl_class_properties(C,shop:heightOfProduct,literal(type(_,H_XSD))),atom_number(H_XSD,H).";
+
+    json_prolog::Prolog pl;
+    outInfo("Preloading product dimensions: " << plQuery.str());
+    try
+    {
+      json_prolog::PrologQueryProxy bdgs = pl.query(plQuery.str());
+      int count = 0;
+      for(auto bdg : bdgs)
+      {
+        std::string cls = bdg["C"];
+        dimsCache_.insert(cls, rs_refills::ProductDims(bdg["H"], bdg["W"], bdg["D"]));
+        ++count;
+      }
+      outInfo("Preloaded dimensions of " << count << " products");
+    }
+    catch(std::exception &e)
+    {
+      outWarn("Preloading product dimensions failed: " << e.what());
+    }
+  }
+
   bool getObjectDims(const std::string obj,
                      double &height, double &width, double &depth)
+  {
+    rs_refills::ProductDims dims;
+    if(dimsCache_.lookup(obj, dims))
+    {
+      height = dims.height;
+      width = dims.width;
+      depth = dims.depth;
+      return true;
+    }
+    return queryObjectDims(obj, height, width, depth);
+  }
+
+  /**
+   * @brief ask the knowledge base without looking into the cache first, the
+   *  answer is stored in the cache; safe to run on another thread
+   */
+  bool queryObjectDims(const std::string obj,
+                       double &height, double &width, double &depth)
   {
     //owl_instance_from_class(shop:'ProductWithAN377954',I),object_dimensions(I,D,W,H).
     std::stringstream plQuery;
@@ -190,6 +349,7 @@ public:
         depth = bdg["D"];
         height = bdg["H"];
         width = bdg["W"];
+        dimsCache_.insert(obj, rs_refills::ProductDims(height, width, depth));
         return true;
         break;
       }
@@ -201,216 +361,38 @@ public:
     return false;
   }
 
-  void filterCloud(const tf::Stamped<tf::Pose> &poseStamped,
-                   const double &width, const double &depth, std::string shelf_type)
+  rs_refills::CropBox facingBox(const tf::Stamped<tf::Pose> &poseStamped,
+                                const double &width, const double &depth, std::string shelf_type)
   {
-    pcl::PassThrough<pcl::PointXYZRGBA> pass;
-    float minX, minY, minZ;
-    float maxX, maxY, maxZ;
-
-    if(shelf_type == "hanging")
-    {
-      minX = poseStamped.getOrigin().x() - width / 2;
-      maxX = poseStamped.getOrigin().x() + width / 2;
-
-      minY = poseStamped.getOrigin().y() - 0.04;
-      maxY = poseStamped.getOrigin().y() + 0.3;
-
-      maxZ = poseStamped.getOrigin().z();
-      minZ = poseStamped.getOrigin().z() - depth;
-    }
-    else if(shelf_type == "standing")
-    {
-      minX = poseStamped.getOrigin().x() + 0.02;
-      maxX = minX + width - 0.04;
-
-      minY = poseStamped.getOrigin().y() - 0.04; //move closer to cam with 2 cm
-      maxY = minY + 0.41; //this can vary between 0.3 and 0.5;
-
-      minZ = poseStamped.getOrigin().z() + 0.015  ; //raise with 2.5 cm
-      maxZ = poseStamped.getOrigin().z() + depth;
-      + 0.02 ; //make sure to get point from the top
-    }
-
-    pass.setInputCloud(cloudFiltered_);
-    pass.setKeepOrganized(true);
-    pass.setFilterFieldName("x");// widht of facing
-    pass.setFilterLimits(minX, maxX);
-    pass.filter(*cloudFiltered_);
-
-    pass.setInputCloud(cloudFiltered_);
-    pass.setFilterFieldName("y");//
-    pass.setFilterLimits(minY, maxY);
-    pass.filter(*cloudFiltered_);
-
-    pass.setInputCloud(cloudFiltered_);
-    pass.setFilterFieldName("z");//
-    pass.setFilterLimits(minZ, maxZ);
-    pass.filter(*cloudFiltered_);
-
-    //    pcl::StatisticalOutlierRemoval<pcl::PointXYZRGBA> sor;
-    //    sor.setInputCloud(cloudFiltered_);
-    //    sor.setMeanK(25);
-    //    sor.setStddevMulThresh(3.0);
-    //    sor.setKeepOrganized(true);
-    //    sor.filter(*cloudFiltered_);
-    outInfo("Size of cloud after filtering: " << cloudFiltered_->size());
-  }
-
-  void clusterCloud(const double &obj_depth, const pcl::PointCloud<pcl::Normal>::Ptr &cloud_normals)
-  {
-    pcl::PointCloud<pcl::Label>::Ptr input_labels(new pcl::PointCloud<pcl::Label>);
-    pcl::Label label;
-    label.label = 0;
-
-    std::vector<bool> ignore_labels;
-    ignore_labels.resize(1);
-    ignore_labels[0] = false;
-
-    input_labels->height = cloudFiltered_->height;
-    input_labels->width = cloudFiltered_->width;
-    input_labels->points.resize(cloudFiltered_->points.size(), label);
-
-
-    pcl ::PointCloud<pcl::Label>::Ptr output_labels(new pcl::PointCloud<pcl::Label>);
-    pcl::EuclideanClusterComparator<pcl::PointXYZRGBA, pcl::Normal, pcl::Label>::Ptr ecc(new pcl::EuclideanClusterComparator<pcl::PointXYZRGBA, pcl::Normal, pcl::Label>());
-    ecc->setInputCloud(cloudFiltered_);
-    ecc->setLabels(input_labels);
-    ecc->setExcludeLabels(ignore_labels);
-    ecc->setDistanceThreshold(0.06, true);
-    ecc->setInputNormals(cloud_normals);
-    std::vector<pcl::PointIndices> cluster_i;
-    pcl::OrganizedConnectedComponentSegmentation<pcl::PointXYZRGBA, pcl::Label> segmenter(ecc);
-    segmenter.setInputCloud(cloudFiltered_);
-    segmenter.segment(*output_labels, cluster_i);
-
-    outInfo("Cluster Size before filtering:" << cluster_i.size());
-
-    for(std::vector<pcl::PointIndices>::iterator it = cluster_i.begin();
-        it != cluster_i.end();)
-    {
-      if(it->indices.size() < 600)
-        it = cluster_i.erase(it);
-      else
-        ++it;
-    }
-
-    outInfo("Cluster Size after filtering:" << cluster_i.size());
-    //if two clusters in the same y range
-    std::vector<pcl::PointIndices> mergedClusterIndices;
-
-    for(int i = 0; i < cluster_i.size(); ++i)
-    {
-      Eigen::Vector4f c1;
-      pcl::compute3DCentroid(*cloudFiltered_, cluster_i[i], c1);
-      bool merged = false;
-      for(int j = 0; j < mergedClusterIndices.size(); j++)
-      {
-        Eigen::Vector4f c2;
-        pcl::compute3DCentroid(*cloudFiltered_, mergedClusterIndices[j], c2);
-        if(std::abs(c1[1] - c2[1]) < obj_depth)
-        {
-            mergedClusterIndices[j].indices.insert(mergedClusterIndices[j].indices.end(),
-                                                   cluster_i[i].indices.begin(),
-                                                   cluster_i[i].indices.end());
-            merged = true;
-            break;
-        }
-      }
-      if (!merged)
-          mergedClusterIndices.push_back(cluster_i[i]);
-    }
-
-    outInfo("Found " << mergedClusterIndices.size() << " good clusters after filtering and merging!");
-
-    float gminX = std::numeric_limits<float>::max(),
-          gminZ = std::numeric_limits<float>::max(),
-          gmaxX = std::numeric_limits<float>::min(),
-          gmaxZ = std::numeric_limits<float>::min();
-    for(int i = 0; i < mergedClusterIndices.size(); ++i)
-    {
-      Eigen::Vector4f  min, max;
-      pcl::getMinMax3D(*cloudFiltered_, mergedClusterIndices[i].indices, min, max);
-      float pdepth = std::abs(min[1] - max[1]);
-      int count = round(pdepth / obj_depth);
-
-      BoundingBox bb;
-      bb.maxPt.x = max[0];
-      bb.maxPt.z = max[2];
-      bb.minPt.x = min[0];
-      bb.minPt.z = min[2];
-
-      if(bb.maxPt.x > gmaxX) gmaxX = bb.maxPt.x;
-      if(bb.maxPt.z > gmaxZ) gmaxZ = bb.maxPt.z;
-      if(bb.minPt.x < gminX) gminX = bb.minPt.x;
-      if(bb.minPt.z < gminZ) gminZ = bb.minPt.z;
-
-      if(count <= 1)
-      {
-        bb.maxPt.y = max[1];
-        bb.minPt.y = min[1];
-        cluster_boxes.push_back(bb);
-        cluster_indices_.push_back(mergedClusterIndices[i]);
-      }
-      else
-      {
-        float step = pdepth / count;
-        outError("Split this cloud into" << count << " piceses");
-        for(int j = 0; j < count; ++j)
-        {
-          pcl::PointIndices newIndices;
-          float minY = min[1] + j * step;
-          float maxY = min[1] + (j + 1) * step;
-          bb.minPt.y = minY;
-          bb.maxPt.y = maxY;
-          cluster_boxes.push_back(bb);
-          pcl::PassThrough<pcl::PointXYZRGBA> pass;
-          pass.setInputCloud(cloudFiltered_);
-          pass.setIndices(boost::make_shared<pcl::PointIndices>(mergedClusterIndices[i]));
-          pass.setFilterFieldName("y");//
-          pass.setFilterLimits(minY, maxY); //full depth of four layered shelf
-          pass.filter(newIndices.indices);
-          if(newIndices.indices.size() > 100) //nois level?
-            cluster_indices_.push_back(newIndices);
-        }
-      }
-      outError("THIS: " << count);
-    }
-
-    //overwrite all dimensions with biggest BB;
-    for(auto &bb : cluster_boxes)
-    {
-      bb.maxPt.x = gmaxX;
-      bb.maxPt.z = gmaxZ;
-      bb.minPt.x = gminX;
-      bb.minPt.z = gminZ;
-    }
+    const tf::Vector3 &origin = poseStamped.getOrigin();
+    return rs_refills::FacingCounter::facingBox(Eigen::Vector3f(origin.x(), origin.y(), origin.z()),
+                                                width, depth, shelf_type);
   }
 
-  void addToCas(CAS &tcas, std::string objToCount)
+  void addToCas(CAS &tcas)
   {
     rs::SceneCas cas(tcas);
     rs::Scene scene = cas.getScene();
-    for(int i = 0; i < cluster_indices_.size(); ++i)
+    for(size_t f = 0; f < facings_.size(); ++f)
     {
-      rs::Cluster hyp = rs::create<rs::Cluster>(tcas);
-      rs::Detection detection = rs::create<rs::Detection>(tcas);
-      detection.source.set("ProductCounter");
-      detection.name.set(objToCount);
-
-      //      tf::Stamped<tf::Pose> pose;
-      //      pose.setOrigin(tf::Vector3(cluster_boxes[i].ptMax.x));
-      //      pose.setRotation(tf::Quaternion(0, 0, 0, 1));
-      //      pose.frame_id_ = "map";
-      //      uint64_t ts = scene.timestamp();
-      //      pose.stamp_ = ros::Time().fromNSec(ts);
-      //      rs::PoseAnnotation poseAnnotation  = rs::create<rs::PoseAnnotation>(tcas);
-      //      poseAnnotation.source.set("ShelfDetector");
-      //      poseAnnotation.world.set(rs::conversion::to(tcas, pose));
-      //      poseAnnotation.camera.set(rs::conversion::to(tcas, pose));
-      hyp.annotations.append(detection);
-      //      hyp.annotations.append(poseAnnotation);
-      scene.identifiables.append(hyp);
+      for(int i = 0; i < counters_[f]->clusterIndices().size(); ++i)
+      {
+        rs::Cluster hyp = rs::create<rs::Cluster>(tcas);
+        rs::Detection detection = rs::create<rs::Detection>(tcas);
+        detection.source.set("ProductCounter");
+        detection.name.set(facings_[f].obj);
+
+        //the separator tells the facings of a batch apart
+        tf::Stamped<tf::Pose> pose = facings_[f].separatorPose;
+        pose.stamp_ = ros::Time().fromNSec(scene.timestamp());
+        rs::PoseAnnotation poseAnnotation  = rs::create<rs::PoseAnnotation>(tcas);
+        poseAnnotation.source.set("ProductCounter");
+        poseAnnotation.world.set(rs::conversion::to(tcas, pose));
+        poseAnnotation.camera.set(rs::conversion::to(tcas, pose));
+        hyp.annotations.append(detection);
+        hyp.annotations.append(poseAnnotation);
+        scene.identifiables.append(hyp);
+      }
     }
   }
 
@@ -418,27 +400,46 @@ public:
   {
     rs::SceneCas cas(tcas);
 
-    std::string objToScan = "" ;
-    std::string shelfType = "";
-    float distToNextSep = 0.0f;
-    tf::Stamped<tf::Pose> separatorPose, nextSeparatorPose;
-    if(!handleQuery(tcas, objToScan, separatorPose, shelfType, distToNextSep)) return false;
-    nextSeparatorPose = separatorPose;
-
-    outInfo("Obj To Scan is: " << objToScan);
-    outInfo("Separator location is: [" << separatorPose.getOrigin().x() << "," << separatorPose.getOrigin().y() << "," << separatorPose.getOrigin().z() << "]");
-    double height = 0.0, width = 0.0, depth = 0.0;
-    getObjectDims(objToScan, height, width, depth);
-    outInfo("height = " << height << " width = " << width << " depth  = " << depth);
-
+    facings_.clear();
+    if(!handleQuery(tcas, facings_)) return false;
+    while(counters_.size() < facings_.size())
+      counters_.emplace_back(new rs_refills::FacingCounter(&counterProfiler_));
+
+    //on a cache miss the knowledge base is asked while the cloud is read,
+    //transformed and cropped, once per product of the query; joined before
+    //the dims are needed. If we leave early the futures block in their
+    //destructor until the queries are done.
+    std::map<std::string, std::shared_future<rs_refills::ProductDims>> pendingDims;
+    for(Facing &facing : facings_)
+    {
+      outInfo("Obj To Scan is: " << facing.obj);
+      outInfo("Separator location is: [" << facing.separatorPose.getOrigin().x() << "," << facing.separatorPose.getOrigin().y() << "," << facing.separatorPose.getOrigin().z() << "]");
+      if(pendingDims.count(facing.obj) || dimsCache_.lookup(facing.obj, facing.dims))
+        continue;
+      const std::string obj = facing.obj;
+      pendingDims[obj] = std::async(std::launch::async, [this, obj]()
+      {
+        rs_refills::ScopedStageTimer timer(this->profiler_, STAGE_PROLOG_LOOKUP);
+        rs_refills::ProductDims d;
+        this->queryObjectDims(obj, d.height, d.width, d.depth);
+        return d;
+      }).share();
+    }
 
-    pcl::PointCloud<pcl::Normal>::Ptr cloud_normals(new pcl::PointCloud<pcl::Normal>);
-    cas.get(VIEW_CLOUD, *cloud_ptr_);
-    cas.get(VIEW_NORMALS, *cloud_normals);
-    cas.get(VIEW_COLOR_IMAGE, rgb_);
+    {
+      rs_refills::ScopedStageTimer timer(profiler_, STAGE_CAS_READ);
+      cas.get(VIEW_CLOUD, *cloud_ptr_);
+      cas.get(VIEW_NORMALS, *normals_);
+      cas.get(VIEW_COLOR_IMAGE, rgb_);
 
 
-    cas.get(VIEW_CAMERA_INFO, camInfo_);
+      cas.get(VIEW_CAMERA_INFO, camInfo_);
+      if(!intrinsics_.valid() || camInfo_.P != intrinsicsP_)
+      {
+        intrinsics_ = rs_refills::CameraIntrinsics(camInfo_.P.data());
+        intrinsicsP_ = camInfo_.P;
+      }
+    }
 
     rs::Scene scene = cas.getScene();
 
@@ -447,25 +448,31 @@ public:
       rs::conversion::from(scene.viewPoint.get(), camToWorld_);
     else if(useLocalFrame_)
     {
+      rs_refills::ScopedStageTimer timer(profiler_, STAGE_TF_LOOKUP);
       try
       {
         //TODO CHANGE THIS ACK TO camInfo._head
         listener->waitForTransform(localFrameName_, camInfo_.header.frame_id, /*ros::Time(0)*/camInfo_.header.stamp, ros::Duration(2));
         listener->lookupTransform(localFrameName_, camInfo_.header.frame_id, /*ros::Time(0)*/camInfo_.header.stamp, camToWorld_);
-        if(separatorPose.frame_id_ != localFrameName_)
+        for(Facing &facing : facings_)
         {
+          tf::Stamped<tf::Pose> &separatorPose = facing.separatorPose;
+          if(separatorPose.frame_id_ != localFrameName_)
+          {
 
-          listener->transformPose(localFrameName_, separatorPose, separatorPose);
+            listener->transformPose(localFrameName_, separatorPose, separatorPose);
 
-          outInfo("New Separator location is: [" << separatorPose.getOrigin().x() << "," << separatorPose.getOrigin().y() << "," << separatorPose.getOrigin().z() << "]");
-        }
+            outInfo("New Separator location is: [" << separatorPose.getOrigin().x() << "," << separatorPose.getOrigin().y() << "," << separatorPose.getOrigin().z() << "]");
+          }
 
-        tf::Vector3 position = separatorPose.getOrigin();
-        position.setX(position.x() + distToNextSep);
-        nextSeparatorPose.setOrigin(position);
+          tf::Stamped<tf::Pose> nextSeparatorPose = separatorPose;
+          tf::Vector3 position = separatorPose.getOrigin();
+          position.setX(position.x() + facing.distToNextSep);
+          nextSeparatorPose.setOrigin(position);
 
-        listener->transformPose(camInfo_.header.frame_id,/* ros::Time(0),*/ separatorPose, /*"map"*/ separatorPoseInImage_);
-        listener->transformPose(camInfo_.header.frame_id,/* ros::Time(0), */nextSeparatorPose,/* "map"*/ nextSeparatorPoseInImage_);
+          listener->transformPose(camInfo_.header.frame_id,/* ros::Time(0),*/ separatorPose, /*"map"*/ facing.separatorPoseInImage);
+          listener->transformPose(camInfo_.header.frame_id,/* ros::Time(0), */nextSeparatorPose,/* "map"*/ facing.nextSeparatorPoseInImage);
+        }
       }
       catch(tf::TransformException &ex)
       {
@@ -474,30 +481,76 @@ public:
       }
     }
 
+    bool anyWidth = false;
+    for(const Facing &facing : facings_)
+      anyWidth |= facing.distToNextSep != 0.0;
+    if(!anyWidth)
+      return false;
+
     Eigen::Affine3d eigenTransform;
     tf::transformTFToEigen(camToWorld_, eigenTransform);
-    pcl::transformPointCloud<pcl::PointXYZRGBA>(*cloud_ptr_, *cloudFiltered_, eigenTransform);
+    const bool batch = facings_.size() > 1;
+    if(batch)
+    {
+      //transform the frame once, every facing crops its part of it
+      rs_refills::transformOrganized(*cloud_ptr_, *shelfCloud_, eigenTransform.cast<float>(), shelfMask_);
+    }
+    else
+    {
+      //the height limits of the facing depend on the product, so transform and
+      //crop on x/y only and cut the height once the dims are there
+      rs_refills::CropBox openBox = facingBox(facings_[0].separatorPose, facings_[0].distToNextSep, 0.15, facings_[0].shelfType);
+      openBox.minZ = -std::numeric_limits<float>::max();
+      openBox.maxZ = std::numeric_limits<float>::max();
+      counters_[0]->filterCloud(*cloud_ptr_, eigenTransform.cast<float>(), openBox);
+      outInfo("Size of cloud after filtering: " << counters_[0]->filteredCloud()->size() << " (" << counters_[0]->validMask().count() << " valid)");
+    }
+
+    {
+      rs_refills::ScopedStageTimer timer(profiler_, STAGE_DIMS_WAIT);
+      for(Facing &facing : facings_)
+      {
+        auto it = pendingDims.find(facing.obj);
+        if(it != pendingDims.end())
+          facing.dims = it->second.get();
+      }
+    }
 
-    //0.4 is shelf_depth
-    if(width != 0.0 && distToNextSep != 0.0)
-      filterCloud(separatorPose, distToNextSep, height, shelfType); //depth of a shelf is given by the shelf_type
-    else if(distToNextSep != 0.0)
+    //facings are independent of each other
+    #pragma omp parallel for schedule(dynamic)
+    for(int i = 0; i < static_cast<int>(facings_.size()); ++i)
     {
+      const Facing &facing = facings_[i];
+      if(facing.distToNextSep == 0.0)
+        continue;
+      //0.4 is shelf_depth
+      //depth of a shelf is given by the shelf_type
       ///0.22 m is the biggest height of object we consider if there is no info
-      filterCloud(separatorPose, distToNextSep, 0.15, shelfType);
+      rs_refills::CropBox box = facingBox(facing.separatorPose, facing.distToNextSep,
+                                          facing.dims.width != 0.0 ? facing.dims.height : 0.15, facing.shelfType);
+      if(batch)
+        counters_[i]->cropCloud(shelfCloud_, shelfMask_, box);
+      else
+        counters_[i]->refineCrop(box);
+      //cluster the filtered cloud and split clusters in chunks of height (on y axes)
+      counters_[i]->clusterCloud(facing.dims.depth, normals_);
     }
-    else
-      return false;
-    //cluster the filtered cloud and split clusters in chunks of height (on y axes)
 
-    clusterCloud(depth, cloud_normals);
-    addToCas(tcas, objToScan);
+    for(size_t i = 0; i < facings_.size(); ++i)
+    {
+      const Facing &facing = facings_[i];
+      outInfo(facing.obj << ": height = " << facing.dims.height << " width = " << facing.dims.width << " depth  = " << facing.dims.depth
+              << ", found " << counters_[i]->clusterIndices().size() << " clusters");
+    }
+    rs_refills::ScopedStageTimer timer(profiler_, STAGE_CAS_WRITE);
+    addToCas(tcas);
     return true;
   }
   TyErrorId processWithLock(CAS &tcas, ResultSpecification const &res_spec)
   {
     outInfo("process start");
     MEASURE_TIME;
+    rs_refills::ScopedStageTimer totalTimer(profiler_, STAGE_TOTAL);
 
     if(external_)
     {
@@ -505,85 +558,43 @@ public:
     }
     else
     {
-      cloudFiltered_->clear();
-      cluster_indices_.clear();
-      cluster_boxes.clear();
+      for(auto &counter : counters_)
+        counter->clear();
       countObject(tcas);
-      drawOnImage();
+      imageDrawn_ = false;
+      if(image_pub_.getNumSubscribers() > 0)
+      {
+        drawOnImage();
+        cv_bridge::CvImage outImgMsgs;
+        outImgMsgs.header = camInfo_.header;
+        outImgMsgs.encoding = sensor_msgs::image_encodings::BGR8;
+        outImgMsgs.image = rgb_;
+        image_pub_.publish(outImgMsgs.toImageMsg());
+      }
     }
     return UIMA_ERR_NONE;
   }
 
-
-  cv::Point2d projection(const tf::Stamped<tf::Pose> pose3D)
-  {
-    std::vector<cv::Point3d> objectPoints;
-    objectPoints.push_back(cv::Point3d(pose3D.getOrigin().x(), pose3D.getOrigin().y(), pose3D.getOrigin().z()));
-
-    // Create the known projection matrix
-
-    cv::Mat P(3, 4, cv::DataType<double>::type);
-    //    P.data = *camInfo_.P.data();
-    P.at<double>(0, 0) = camInfo_.P[0];
-    P.at<double>(1, 0) = camInfo_.P[4];
-    P.at<double>(2, 0) = camInfo_.P[8];
-
-    P.at<double>(0, 1) = camInfo_.P[1];
-    P.at<double>(1, 1) = camInfo_.P[5];
-    P.at<double>(2, 1) = camInfo_.P[9];
-
-    P.at<double>(0, 2) = camInfo_.P[2];
-    P.at<double>(1, 2) = camInfo_.P[6];
-    P.at<double>(2, 2) = camInfo_.P[10];
-
-    P.at<double>(0, 3) = camInfo_.P[3];
-    P.at<double>(1, 3) = camInfo_.P[7];
-    P.at<double>(2, 3) = camInfo_.P[11];
-
-    // Decompose the projection matrix into:
-    cv::Mat K(3, 3, cv::DataType<double>::type); // intrinsic parameter matrix
-    cv::Mat rvec(3, 3, cv::DataType<double>::type); // rotation matrix
-    cv::Mat Thomogeneous(4, 1, cv::DataType<double>::type); // translation vector
-
-    cv::decomposeProjectionMatrix(P, K, rvec, Thomogeneous);
-
-    cv::Mat T(3, 1, cv::DataType<double>::type); // translation vector
-    //    cv::convertPointsHomogeneous(Thomogeneous, T);
-    T.at<double>(0) = 0.0;
-    T.at<double>(1) = 0.0;
-    T.at<double>(2) = 0.0;
-
-    std::cout << "K: " << K << std::endl;
-    std::cout << "rvec: " << rvec << std::endl;
-    std::cout << "T: " << T << std::endl;
-
-    // Create zero distortion
-    cv::Mat distCoeffs(4, 1, cv::DataType<double>::type);
-    distCoeffs.at<double>(0) = 0;
-    distCoeffs.at<double>(1) = 0;
-    distCoeffs.at<double>(2) = 0;
-    distCoeffs.at<double>(3) = 0;
-
-    std::vector<cv::Point2d> projectedPoints;
-
-    cv::Mat rvecR(3, 1, cv::DataType<double>::type); //rodrigues rotation matrix
-    //    cv::Rodrigues(rvec,rvecR);
-    rvecR.at<double>(0) = 0.0;
-    rvecR.at<double>(1) = 0.0;
-    rvecR.at<double>(2) = 0.0;
-
-    cv::projectPoints(objectPoints, rvecR, T, K, distCoeffs, projectedPoints);
-    return projectedPoints[0];
-  }
-
+  /**
+   * @brief draw the clusters and separators of the last frame into rgb_, once per frame
+   */
   void drawOnImage()
   {
-    for(int j = 0; j < cluster_indices_.size(); ++j)
+    if(imageDrawn_ || rgb_.empty())
+      return;
+    rs_refills::ScopedStageTimer timer(profiler_, STAGE_DRAWING);
+    imageDrawn_ = true;
+    int color = 0;
+    for(size_t f = 0; f < facings_.size(); ++f)
     {
-      for(int i = 0; i < cluster_indices_[j].indices.size(); ++i)
+      const std::vector<pcl::PointIndicesPtr> &cluster_indices_ = counters_[f]->clusterIndices();
+      for(int j = 0; j < cluster_indices_.size(); ++j, ++color)
       {
-        int index = cluster_indices_[j].indices[i];
-        rgb_.at<cv::Vec3b>(index) = rs::common::cvVec3bColors[j % rs::common::numberOfColors];
+        for(int i = 0; i < cluster_indices_[j]->indices.size(); ++i)
+        {
+          int index = cluster_indices_[j]->indices[i];
+          rgb_.at<cv::Vec3b>(index) = rs::common::cvVec3bColors[color % rs::common::numberOfColors];
+        }
       }
     }
 
@@ -619,27 +630,35 @@ public:
         }
     */
 
-    //THE NICE WAY
-    cv::Point leftSepInImage =  projection(separatorPoseInImage_);
-
-    cv::Point rightSepInImage =  projection(nextSeparatorPoseInImage_);
-    if(leftSepInImage.y > camInfo_.height) leftSepInImage.y =  camInfo_.height - 2;
-    if(rightSepInImage.y > camInfo_.height) rightSepInImage.y =  camInfo_.height - 2;
-
-    outInfo("Left Sep image coords: " << leftSepInImage);
-    outInfo("Right Sep image coords: " << rightSepInImage);
-    cv::circle(rgb_, leftSepInImage, 5, cv::Scalar(255, 255, 0), 3);
-    cv::circle(rgb_, rightSepInImage, 5, cv::Scalar(0, 255, 255), 3);
-
-    cv_bridge::CvImage outImgMsgs;
-    outImgMsgs.header = camInfo_.header;
-    outImgMsgs.encoding = sensor_msgs::image_encodings::BGR8;
-    outImgMsgs.image = rgb_;
-    image_pub_.publish(outImgMsgs.toImageMsg());
+    //THE NICE WAY: both separators of all facings in one go
+    separatorPoints_.clear();
+    for(const Facing &facing : facings_)
+    {
+      const tf::Vector3 &l = facing.separatorPoseInImage.getOrigin(), &r = facing.nextSeparatorPoseInImage.getOrigin();
+      separatorPoints_.push_back(Eigen::Vector3f(l.x(), l.y(), l.z()));
+      separatorPoints_.push_back(Eigen::Vector3f(r.x(), r.y(), r.z()));
+    }
+    intrinsics_.project(separatorPoints_, separatorPixels_);
+    for(size_t f = 0; f < facings_.size(); ++f)
+    {
+      const Eigen::Vector2f &l = separatorPixels_[2 * f], &r = separatorPixels_[2 * f + 1];
+      if(!l.allFinite() || !r.allFinite())
+        continue;
+      cv::Point leftSepInImage(l[0], l[1]);
+      cv::Point rightSepInImage(r[0], r[1]);
+      if(leftSepInImage.y > camInfo_.height) leftSepInImage.y =  camInfo_.height - 2;
+      if(rightSepInImage.y > camInfo_.height) rightSepInImage.y =  camInfo_.height - 2;
+
+      outInfo("Left Sep image coords: " << leftSepInImage);
+      outInfo("Right Sep image coords: " << rightSepInImage);
+      cv::circle(rgb_, leftSepInImage, 5, cv::Scalar(255, 255, 0), 3);
+      cv::circle(rgb_, rightSepInImage, 5, cv::Scalar(0, 255, 255), 3);
+    }
   }
 
   void drawImageWithLock(cv::Mat &disp)
   {
+    drawOnImage();
     if(!rgb_.empty())
       disp = rgb_.clone();
     else disp = cv::Mat::ones(480, 640, CV_8UC3);
@@ -649,25 +668,30 @@ public:
   {
     const std::string &cloudname = "cloud";
     double pointSize = 1.0;
+    //a single facing shows its crop, a batch the whole frame
+    pcl::PointCloud<pcl::PointXYZRGBA>::Ptr dispCloud = facings_.size() == 1 ? counters_[0]->filteredCloud() : shelfCloud_;
     if(firstRun)
     {
-      visualizer.addPointCloud(cloudFiltered_, cloudname);
+      visualizer.addPointCloud(dispCloud, cloudname);
       visualizer.setPointCloudRenderingProperties(pcl::visualization::PCL_VISUALIZER_POINT_SIZE, pointSize, cloudname);
     }
     else
     {
-      visualizer.updatePointCloud(cloudFiltered_,  cloudname);
+      visualizer.updatePointCloud(dispCloud,  cloudname);
       visualizer.getPointCloudRenderingProperties(pcl::visualization::PCL_VISUALIZER_POINT_SIZE, pointSize, cloudname);
       visualizer.removeAllShapes();
     }
     int idx = 0;
 
 
-    for(auto &bb : cluster_boxes)
+    for(size_t f = 0; f < facings_.size(); ++f)
     {
-      visualizer.addCube(bb.minPt.x, bb.maxPt.x, bb.minPt.y, bb.maxPt.y, bb.minPt.z, bb.maxPt.z, 1.0, 1.0, 1.0,
-                         "box_" + std::to_string(idx));
-      idx++;
+      for(auto &bb : counters_[f]->clusterBoxes())
+      {
+        visualizer.addCube(bb.minPt.x, bb.maxPt.x, bb.minPt.y, bb.maxPt.y, bb.minPt.z, bb.maxPt.z, 1.0, 1.0, 1.0,
+                           "box_" + std::to_string(idx));
+        idx++;
+      }
     }
     visualizer.setRepresentationToWireframeForAllActors();
   }
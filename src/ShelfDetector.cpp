@@ -8,23 +8,6 @@
 
 #include <pcl/point_types.h>
 
-#include <pcl/filters/filter.h>
-#include <pcl/filters/statistical_outlier_removal.h>
-#include <pcl/filters/voxel_grid.h>
-#include <pcl/filters/extract_indices.h>
-#include <pcl/filters/radius_outlier_removal.h>
-#include <pcl/filters/shadowpoints.h>
-#include <pcl/filters/passthrough.h>
-
-#include <pcl/features/boundary.h>
-#include <pcl/features/organized_edge_detection.h>
-
-#include <pcl/common/transforms.h>
-#include <pcl/sample_consensus/ransac.h>
-#include <pcl/sample_consensus/sac_model_line.h>
-#include <pcl/sample_consensus/sac_model_parallel_line.h>
-#include <pcl/ModelCoefficients.h>
-
 #include <rs/types/all_types.h>
 #include <rs/scene_cas.h>
 #include <rs/utils/time.h>
@@ -34,6 +17,17 @@
 #include <rapidjson/rapidjson.h>
 #include <rapidjson/document.h>
 
+#include <algorithm>
+#include <map>
+#include <memory>
+
+#include <rs_refills/core/shelf_line_detector.h>
+#include <rs_refills/core/scan_pipeline.h>
+#include <rs_refills/core/fused_shelf_map.h>
+#include <rs_refills/core/viewpoint_gate.h>
+#include <rs_refills/utils/camera_intrinsics.h>
+#include <rs_refills/utils/stage_profiler.h>
+
 using namespace uima;
 
 /**
@@ -50,32 +44,33 @@ using namespace uima;
 class ShelfDetector : public DrawingAnnotator
 {
   ros::NodeHandle nh_;
-  pcl::PointCloud<pcl::PointXYZRGBA>::Ptr cloud_, dispCloud_;
-  pcl::PointCloud<pcl::PointXYZRGBA>::Ptr cloud_filtered_;
-  pcl::PointCloud<pcl::Normal>::Ptr normals_;
-
-  std::vector<pcl::PointIndices> label_indices_;
-  std::vector<pcl::PointIndicesPtr> line_inliers_;
-
-  std::vector<Eigen::VectorXf> line_models_;
-
-  int min_line_inliers_;
-  float max_variance_;
+  pcl::PointCloud<pcl::PointXYZRGBA>::Ptr cloud_;
+
+  //cropping, line extraction and the layer map of the scan
+  rs_refills::ShelfLineDetector detector_;
+  //pipelined scan (pipeline_workers > 0): frames are handed to the pipeline
+  //and the annotator returns right away, detector_ is then only used for display
+  std::unique_ptr<rs_refills::ScanPipeline> pipeline_;
+  rs_refills::ShelfLineMap pipelineMap_;
+
+  //fused scan (fuse_scan): the edges of every frame go into the map of the
+  //shelf system (location of the query), lines are extracted once on stop
+  bool fuseScan_;
+  rs_refills::FusedShelfMap::Parameters fusionParams_;
+  std::map<std::string, rs_refills::FusedShelfMap> fusedMaps_;
+  pcl::PointCloud<pcl::PointXYZRGBA> fusedVoxels_;
 
   tf::StampedTransform camToWorld_;
 
   sensor_msgs::CameraInfo camInfo_;
+  //parsed from camInfo_.P whenever that changes
+  rs_refills::CameraIntrinsics intrinsics_;
+  sensor_msgs::CameraInfo::_P_type intrinsicsP_;
 
-  struct Line
-  {
-    pcl::PointXYZRGBA pt_begin;
-    pcl::PointXYZRGBA pt_end;
-    uint8_t id;
-  };
-
-  std::vector<Line> lines_;
+  //skips frames that show no new part of the shelf system
+  rs_refills::ViewpointGate gate_;
 
-  cv::Mat mask_, rgb_, disp_, bin_, grey_;
+  cv::Mat rgb_;
 
 
   tf::TransformListener *listener;
@@ -88,17 +83,28 @@ class ShelfDetector : public DrawingAnnotator
     BINARY,
     GREY
   } dispMode;
+  //the image lines are only for display, they are computed once someone looks, and only if
+  //the detector ran on the current frame (not gated, pipelined or fused), else its mask is older
+  bool frameProcessed_, imageLinesFound_;
 
   std::string localFrameName_;
+
+  //per stage latencies of the annotator itself, the algorithm stages are
+  //profiled by the detector; both are reported on destroy
+  enum Stage
+  {
+    STAGE_TOTAL,
+    STAGE_CAS_READ,
+    STAGE_CAS_WRITE
+  };
+  rs_refills::StageProfiler profiler_;
+  std::string latencyReportFile_;
 public:
 
-  ShelfDetector(): DrawingAnnotator(__func__), nh_("~"), min_line_inliers_(50), max_variance_(0.01), dispMode(DisplayMode::EDGE)
+  ShelfDetector(): DrawingAnnotator(__func__), nh_("~"), fuseScan_(false), dispMode(DisplayMode::EDGE),
+    frameProcessed_(false), imageLinesFound_(false), profiler_({"total", "cas_read", "cas_write"})
   {
     cloud_ = boost::make_shared<pcl::PointCloud<pcl::PointXYZRGBA>>();
-    dispCloud_ = boost::make_shared<pcl::PointCloud<pcl::PointXYZRGBA>>();
-    cloud_filtered_ = boost::make_shared<pcl::PointCloud<pcl::PointXYZRGBA>>();
-
-    normals_ = boost::make_shared<pcl::PointCloud<pcl::Normal>>();
 
     listener = new tf::TransformListener(nh_, ros::Duration(10.0));
   }
@@ -106,8 +112,84 @@ public:
   TyErrorId initialize(AnnotatorContext &ctx)
   {
     outInfo("initialize");
-    ctx.extractValue("min_line_inliers", min_line_inliers_);
-    ctx.extractValue("max_variance", max_variance_);
+    rs_refills::ShelfLineDetector::Parameters params;
+    ctx.extractValue("min_line_inliers", params.minLineInliers);
+    ctx.extractValue("max_variance", params.maxVariance);
+    if(ctx.isParameterDefined("max_lines"))
+      ctx.extractValue("max_lines", params.maxLines);
+    if(ctx.isParameterDefined("ransac_seed"))
+    {
+      int seed;
+      ctx.extractValue("ransac_seed", seed);
+      params.lineExtraction.seed = static_cast<unsigned int>(seed);
+    }
+    if(ctx.isParameterDefined("outlier_filter"))
+    {
+      std::string filter;
+      ctx.extractValue("outlier_filter", filter);
+      if(filter == "sor")
+        params.outlierFilter = rs_refills::ShelfLineDetector::OUTLIER_SOR;
+      else if(filter == "none")
+        params.outlierFilter = rs_refills::ShelfLineDetector::OUTLIER_NONE;
+      else if(filter == "organized")
+        params.outlierFilter = rs_refills::ShelfLineDetector::OUTLIER_ORGANIZED;
+      else
+        outWarn("Unknown outlier_filter " << filter << ", using sor");
+    }
+    if(ctx.isParameterDefined("edge_source"))
+    {
+      std::string source;
+      ctx.extractValue("edge_source", source);
+      if(source == "image")
+        params.edgeSource = rs_refills::ShelfLineDetector::EDGES_IMAGE;
+      else if(source == "cloud")
+        params.edgeSource = rs_refills::ShelfLineDetector::EDGES_CLOUD;
+      else
+        outWarn("Unknown edge_source " << source << ", using cloud");
+    }
+    if(ctx.isParameterDefined("fuse_scan"))
+      ctx.extractValue("fuse_scan", fuseScan_);
+    if(ctx.isParameterDefined("fusion_min_observations"))
+      ctx.extractValue("fusion_min_observations", fusionParams_.minObservations);
+    //the fusion filters the noise, single frames need no outlier removal
+    if(fuseScan_)
+      params.outlierFilter = rs_refills::ShelfLineDetector::OUTLIER_NONE;
+    detector_.setParameters(params);
+    rs_refills::ViewpointGate::Parameters gateParams;
+    //the camera looks at the shelf system from -y, its front face is the near side of the crop
+    gateParams.shelfPlaneY = params.shelfMeter.minY;
+    if(ctx.isParameterDefined("max_view_overlap"))
+      ctx.extractValue("max_view_overlap", gateParams.maxOverlap);
+    if(ctx.isParameterDefined("max_view_rotation"))
+      ctx.extractValue("max_view_rotation", gateParams.maxRotation);
+    gate_.setParameters(gateParams);
+    int workers = 0;
+    if(ctx.isParameterDefined("pipeline_workers"))
+      ctx.extractValue("pipeline_workers", workers);
+    if(workers > 0 && fuseScan_)
+    {
+      outWarn("fuse_scan is set, pipeline_workers is ignored");
+    }
+    else if(workers > 0 && params.edgeSource == rs_refills::ShelfLineDetector::EDGES_IMAGE)
+    {
+      outWarn("edge_source is image, pipeline_workers is ignored");
+    }
+    else if(workers > 0)
+    {
+      rs_refills::ScanPipeline::Parameters pipelineParams;
+      pipelineParams.workers = workers;
+      pipelineParams.detector = params;
+      if(ctx.isParameterDefined("pipeline_capacity"))
+      {
+        int capacity;
+        ctx.extractValue("pipeline_capacity", capacity);
+        pipelineParams.capacity = std::max(1, capacity);
+      }
+      pipeline_.reset(new rs_refills::ScanPipeline(pipelineParams));
+      outInfo("Pipelined scan with " << workers << " workers, " << pipelineParams.capacity << " frames buffered");
+    }
+    if(ctx.isParameterDefined("latency_report"))
+      ctx.extractValue("latency_report", latencyReportFile_);
     setAnnotatorContext(ctx);
     return UIMA_ERR_NONE;
   }
@@ -115,74 +197,37 @@ public:
   TyErrorId destroy()
   {
     outInfo("destroy");
+    //with the pipeline the lines of most frames are extracted by its workers
+    std::vector<const rs_refills::StageProfiler *> profilers = {&profiler_, &detector_.profiler()};
+    if(pipeline_)
+    {
+      pipeline_->mergeDetectorProfilers(detector_.profiler());
+      profilers.push_back(&pipeline_->profiler());
+    }
+    std::string report;
+    for(const rs_refills::StageProfiler *profiler : profilers)
+      report += profiler->report();
+    outInfo("Stage latencies:" << std::endl << report);
+    if(!latencyReportFile_.empty() && !rs_refills::StageProfiler::writeReports(latencyReportFile_, profilers))
+      outWarn("Could not write latency report to " << latencyReportFile_);
+    outInfo("Line inlier lists allocated: " << detector_.allocations());
+    outInfo("Viewpoint gate: " << gate_.accepted() << " frames processed, " << gate_.skipped() << " skipped");
+    if(pipeline_)
+    {
+      outInfo("Pipeline: " << pipeline_->merged() << " frames merged, " << pipeline_->dropped() << " dropped");
+      pipeline_.reset();
+    }
     return UIMA_ERR_NONE;
   }
 
-  void projectPointOnPlane(pcl::PointXYZRGBA &pt, const std::vector<float> &plane_model)
-  {
-    assert(plane_model.size() == 4);
-    cv::Point3f normal(plane_model[0], plane_model[1], plane_model[2]);
-    float planeDist = plane_model[3];
-    cv::Point3f point(pt.x, pt.y, pt.z);
-    float pointDist = point.dot(normal);
-    float t = planeDist + pointDist;
-    cv::Point3f projected = point - normal * t;
-    pt.x = projected.x;
-    pt.z = projected.z;
-    pt.y = projected.y;
-  }
-
-  void projectPointCloudOnPlane(pcl::PointCloud<pcl::PointXYZRGBA>::Ptr &cloud, const std::vector<float> &plane_model)
+  const rs_refills::ShelfLineMap &lineMap() const
   {
-    for(auto &p : cloud->points)
-      projectPointOnPlane(p, plane_model);
+    return pipeline_ ? pipelineMap_ : detector_.lineMap();
   }
 
-  void solveLineIds()
+  bool imageEdges() const
   {
-    for(auto inliers : line_inliers_)
-    {
-      Line line;
-      line.pt_begin = cloud_filtered_->points[inliers->indices[0]];
-      line.pt_begin = cloud_filtered_->points[inliers->indices[0]];
-      std::for_each(inliers->indices.begin() + 1, inliers->indices.end(), [&line, this](int n)
-      {
-        if(this->cloud_filtered_->points[n].x < line.pt_begin.x)
-        {
-          line.pt_begin = this->cloud_filtered_->points[n];
-        }
-
-        if(this->cloud_filtered_->points[n].x > line.pt_end.x)
-        {
-          line.pt_end = this->cloud_filtered_->points[n];
-        }
-      });
-      bool found = false;
-      for(auto &l : lines_)
-      {
-        double distb = rs::common::pointToPointDistance2DSqrt(l.pt_begin.y, l.pt_begin.z,  line.pt_begin.y, line.pt_begin.z);
-        double diste = rs::common::pointToPointDistance2DSqrt(l.pt_end.y, l.pt_end.z,  line.pt_end.y, line.pt_end.z);
-        if(distb < 0.1 && diste < 0.1)
-        {
-          found = true;
-          l.pt_begin.x = (l.pt_begin.x + line.pt_begin.x) / 2;
-          l.pt_begin.y = (l.pt_begin.y + line.pt_begin.y) / 2;
-          l.pt_begin.z = (l.pt_begin.z + line.pt_begin.z) / 2;
-
-          l.pt_end.x = (l.pt_end.x + line.pt_end.x) / 2;
-          l.pt_end.y = (l.pt_end.y + line.pt_end.y) / 2;
-          l.pt_end.z = (l.pt_end.z + line.pt_end.z) / 2;
-
-          break;
-        }
-      }
-
-      if(!found && line.pt_begin.z < 1.85)
-      {
-        line.id = lines_.size();
-        lines_.push_back(line);
-      }
-    }
+    return detector_.getParameters().edgeSource == rs_refills::ShelfLineDetector::EDGES_IMAGE;
   }
 
   void addToCas(CAS &tcas)
@@ -190,14 +235,15 @@ public:
     rs::SceneCas cas(tcas);
     rs::Scene scene = cas.getScene();
 
-    for(auto line : lines_)
+    for(const auto &layer : lineMap().layers())
     {
       rs::Cluster hyp = rs::create<rs::Cluster>(tcas);
       rs::Detection detection = rs::create<rs::Detection>(tcas);
       detection.source.set("ShelfDetector");
-      detection.name.set(std::to_string(line.id));
+      detection.name.set(std::to_string(layer.id));
       tf::Stamped<tf::Pose> pose;
-      pose.setOrigin(tf::Vector3(line.pt_begin.x, line.pt_begin.y, line.pt_begin.z));
+      const Eigen::Vector3f &begin = layer.begin.mean;
+      pose.setOrigin(tf::Vector3(begin[0], begin[1], begin[2]));
       pose.setRotation(tf::Quaternion(0, 0, 0, 1));
       pose.frame_id_ = "map";
       uint64_t ts = scene.timestamp();
@@ -213,45 +259,14 @@ public:
     }
   }
 
-  void makeMaskedImage()
+  void drawImageLines(cv::Mat &disp)
   {
-    mask_ = rgb_.clone();
-    for(int i = 0; i < cloud_filtered_->points.size(); ++i)
+    for(const cv::Vec4i &l : detector_.imageLines())
     {
-      if(!pcl::isFinite(cloud_filtered_->points[i]))
-      {
-        cv::Vec3f color(0, 0, 0);
-        mask_.at<cv::Vec3b>(i) = color;
-      }
+      cv::line(disp, cv::Point(l[0], l[1]), cv::Point(l[2], l[3]), cv::Scalar(0, 0, 255), 3, cv::LINE_AA);
     }
   }
 
-  void findLinesInImage()
-  {
-    cv::Mat edge, dilatedCanny;
-    cv::cvtColor(mask_, grey_, cv::COLOR_BGR2GRAY);
-
-    cv::threshold(grey_, bin_, 150, 255, cv::THRESH_BINARY);
-    cv::Canny(bin_, edge, 50, 150);
-    cv::Mat element = getStructuringElement(cv::MORPH_CROSS,
-                                            cv::Size(3, 3),
-                                            cv::Point(2, 2));
-    cv::dilate(edge, dilatedCanny, element);
-
-
-    disp_ = dilatedCanny.clone();
-
-    std::vector<cv::Vec4i> linesP; // will hold the results of the detection
-    cv::HoughLinesP(dilatedCanny, linesP, 1, CV_PI / 180, 50, 400, 15); // runs the actual detection
-    // Draw the lines
-    for(size_t i = 0; i < linesP.size(); i++)
-    {
-      cv::Vec4i l = linesP[i];
-      cv::line(rgb_, cv::Point(l[0], l[1]), cv::Point(l[2], l[3]), cv::Scalar(0, 0, 255), 3, cv::LINE_AA);
-    }
-
-  }
-
   bool callbackKey(const int key, const Source source)
   {
     switch(key)
@@ -273,168 +288,26 @@ public:
     return false;
   }
 
-  bool findLinesInCloud()
-  {
-    pcl::OrganizedEdgeFromNormals<pcl::PointXYZRGBA, pcl::Normal, pcl::Label> oed;
-    oed.setInputNormals(normals_);
-    oed.setInputCloud(cloud_filtered_);
-    oed.setDepthDisconThreshold(0.05);
-    oed.setMaxSearchNeighbors(0.03);
-    oed.setEdgeType(oed.EDGELABEL_NAN_BOUNDARY);
-    pcl::PointCloud<pcl::Label> labels;
-
-    oed.compute(labels, label_indices_);
-    if(label_indices_[0].indices.size() == 0)
-    {
-      outWarn("No NaN boundaries found. Exiting annotator");
-      return false;
-    }
-
-    pcl::ExtractIndices<pcl::PointXYZRGBA> ei;
-    outInfo("Before filter: " << cloud_filtered_->points.size());
-    ei.setInputCloud(cloud_filtered_);
-    //this is the bullshit of PCL...one algo returns PointIndices next algo want a f'in pointer
-    ei.setIndices(boost::make_shared<pcl::PointIndices>(label_indices_[0]));
-    ei.setKeepOrganized(true);
-    ei.filterDirectly(cloud_filtered_);
-
-    pcl::VoxelGrid<pcl::PointXYZRGBA> vg;
-    vg.setInputCloud(cloud_filtered_);
-    vg.setLeafSize(0.02, 0.02, 0.02);
-    vg.filter(*cloud_filtered_);
-
-    //    pcl::PointCloud <pcl::PointXYZRGBA>::Ptr edge_cloud(new pcl::PointCloud<pcl::PointXYZRGBA>);
-    pcl::PointCloud <pcl::PointXYZRGBA>::Ptr edge_cloud = cloud_filtered_->makeShared();
-
-    std::vector<float> xz_plane{0.0, 1.0, 0.0, 0.5};
-    projectPointCloudOnPlane(edge_cloud, xz_plane);
-
-    //TODO what should be a stop criteria here?
-    int count = 0;
-    int remaining_points = edge_cloud->size();
-    while(count++ < 5 && remaining_points > 0)
-    {
-
-      //lines parallel to the X-AXES (THIS CAN CHANGE)
-      pcl::SampleConsensusModelParallelLine<pcl::PointXYZRGBA>::Ptr
-      model_pl(new pcl::SampleConsensusModelParallelLine<pcl::PointXYZRGBA> (edge_cloud));
-      model_pl->setAxis(Eigen::Vector3f(1.0, 0, 0));
-
-      outInfo("edge_cloud.size: " << edge_cloud->size());
-      pcl::search::Search<pcl::PointXYZRGBA>::Ptr search(new pcl::search::KdTree<pcl::PointXYZRGBA>);
-      search->setInputCloud(edge_cloud);
-      outInfo("kdTree created");
-      model_pl->setSamplesMaxDist(0.07, search);
-      model_pl->setEpsAngle(1.5 * M_PI / 180);
-
-      pcl::RandomSampleConsensus<pcl::PointXYZRGBA> ransac(model_pl);
-      ransac.setDistanceThreshold(0.01);
-
-      ransac.computeModel();
-      pcl::PointIndicesPtr inliers(new pcl::PointIndices());
-      ransac.getInliers(inliers->indices);
-
-      float avg_y = 0;
-      std::for_each(inliers->indices.begin(), inliers->indices.end(), [&avg_y, this](int n)
-      {
-        avg_y += this->cloud_filtered_->points[n].y;
-      }
-                   );
-      avg_y = avg_y / inliers->indices.size();
-      float ssd = 0;
-      std::for_each(inliers->indices.begin(), inliers->indices.end(), [avg_y, &ssd, this](int n)
-      {
-        ssd += (this->cloud_filtered_->points[n].y - avg_y) * (this->cloud_filtered_->points[n].y - avg_y);
-      }
-                   );
-
-      float var = std::sqrt(ssd / (inliers->indices.size()));
-
-
-      //the variance on y needs to be small
-      if(inliers->indices.size() > min_line_inliers_ && var < max_variance_)
-      {
-        outInfo("variance is : " << var);
-        outInfo("Line inliers found: " << inliers->indices.size());
-        Eigen::VectorXf model_coeffs;
-        ransac.getModelCoefficients(model_coeffs);
-        outInfo("x = " << model_coeffs[0] << " y = " << model_coeffs[1] << " z = " << model_coeffs[2]);
-        line_models_.push_back(model_coeffs);
-        line_inliers_.push_back(inliers);
-      }
-      else
-      {
-        outWarn("variance was: " << var);
-        outWarn("inliers was:  " << inliers->indices.size());
-      }
-      ei.setInputCloud(edge_cloud);
-      ei.setIndices(inliers);
-      ei.setNegative(true);
-      ei.setKeepOrganized(true);
-      ei.filterDirectly(edge_cloud);
-      remaining_points -= inliers->indices.size();
-    }
-    return true;
-  }
-
-  void filterCloud(const tf::StampedTransform &poseStamped)
-  {
-    pcl::PassThrough<pcl::PointXYZRGBA> pass;
-    float minX, minY, minZ;
-    float maxX, maxY, maxZ;
-
-    minX = 0.001 ;
-    maxX = minX + 0.98; //1m shelf
-
-    minY = -0.04; //move closer to cam with 2 cm
-    maxY = minY + 0.25; //the deepest shelf
-
-    minZ = 0.15 ; //bottom shelf is not interesting
-    maxZ = minZ + 1.8; //make sure to get point from the top
-
-    pass.setInputCloud(cloud_);
-    pass.setKeepOrganized(true);
-    pass.setFilterFieldName("x");
-    pass.setFilterLimits(minX, maxX);
-    pass.filter(*cloud_filtered_);
-
-    pass.setInputCloud(cloud_filtered_);
-    pass.setFilterFieldName("y");//
-    pass.setFilterLimits(minY, maxY);
-    pass.filter(*cloud_filtered_);
-
-    pass.setInputCloud(cloud_filtered_);
-    pass.setFilterFieldName("z");//
-    pass.setFilterLimits(minZ, maxZ);
-    pass.filter(*cloud_filtered_);
-
-    {
-      MEASURE_TIME;
-      pcl::StatisticalOutlierRemoval<pcl::PointXYZRGBA> sor;
-      sor.setInputCloud(cloud_filtered_);
-      sor.setKeepOrganized(true);
-      sor.setMeanK(30);
-      sor.setStddevMulThresh(0.5);
-      sor.filter(*cloud_filtered_);
-      outInfo("SOR filter");
-    }
-
-    *dispCloud_ = *cloud_filtered_;
-  }
-
-
   TyErrorId processWithLock(CAS &tcas, ResultSpecification const &res_spec)
   {
     outInfo("process start");
     MEASURE_TIME;
-    label_indices_.clear();
-    line_inliers_.clear();
+    rs_refills::ScopedStageTimer totalTimer(profiler_, STAGE_TOTAL);
 
     rs::SceneCas cas(tcas);
-    cas.get(VIEW_CLOUD, *cloud_);
-    cas.get(VIEW_NORMALS, *normals_);
-    cas.get(VIEW_COLOR_IMAGE, rgb_);
-    cas.get(VIEW_CAMERA_INFO, camInfo_);
+    {
+      rs_refills::ScopedStageTimer timer(profiler_, STAGE_CAS_READ);
+      cas.get(VIEW_CLOUD, *cloud_);
+      cas.get(VIEW_COLOR_IMAGE, rgb_);
+      cas.get(VIEW_CAMERA_INFO, camInfo_);
+      if(!intrinsics_.valid() || camInfo_.P != intrinsicsP_)
+      {
+        intrinsics_ = rs_refills::CameraIntrinsics(camInfo_.P.data());
+        intrinsicsP_ = camInfo_.P;
+      }
+      frameProcessed_ = false;
+      imageLinesFound_ = false;
+    }
 
     std::string queryAsString = "";
     rs::Query query = rs::create<rs::Query>(tcas);
@@ -489,26 +362,86 @@ public:
         outError(ex.what());
         return UIMA_ERR_NONE;
       }
+
       Eigen::Affine3d eigenTransform;
       tf::transformTFToEigen(camToWorld_, eigenTransform);
-      pcl::transformPointCloud<pcl::PointXYZRGBA>(*cloud_, *cloud_, eigenTransform);
-
-      filterCloud(camToWorld_);
+      //the region of a frame only counts as seen once the frame made it through
+      if(!gate_.wouldAccept(eigenTransform.cast<float>(), intrinsics_, camInfo_.width, camInfo_.height))
+      {
+        outInfo("Viewpoint already seen, skipping the frame (" << gate_.skipped() << " skipped, "
+                << gate_.accepted() << " processed)");
+      }
+      else if(fuseScan_)
+      {
+        detector_.filterCloud(*cloud_, eigenTransform.cast<float>());
+        if(detector_.findEdges())
+        {
+          //a map per shelf system, only built for the first frame of it
+          auto fused = fusedMaps_.find(localFrameName_);
+          if(fused == fusedMaps_.end())
+            fused = fusedMaps_.emplace(localFrameName_, rs_refills::FusedShelfMap(fusionParams_)).first;
+          fused->second.addFrame(*detector_.edgeCloud());
+          gate_.commit();
+        }
+      }
+      else if(pipeline_)
+      {
+        if(pipeline_->push(*cloud_, eigenTransform.cast<float>()))
+          gate_.commit();
+        else
+          outWarn("Scan pipeline is full, dropped the frame");
+      }
+      //without an image the detector skips the image lines, see drawImageWithLock;
+      //the image edges need them for the lines themselves
+      else if(!detector_.process(*cloud_, imageEdges() ? rgb_ : cv::Mat(), eigenTransform.cast<float>()))
+      {
+        outWarn("No shelf edges found. Exiting annotator");
+      }
+      else
+      {
+        gate_.commit();
+        frameProcessed_ = true;
+        imageLinesFound_ = imageEdges();
+        outInfo("Found " << detector_.lineInliers().size() << " lines");
+      }
+    }
 
-      makeMaskedImage();
-      findLinesInImage();
-      findLinesInCloud();
+    auto fused = fusedMaps_.find(localFrameName_);
+    if(reset && fused != fusedMaps_.end())
+    {
+      fused->second.extract(fusedVoxels_);
+      outInfo("Fused " << fused->second.frames() << " frames of " << localFrameName_ << ": "
+              << fused->second.size() << " voxels, " << fusedVoxels_.size() << " seen often enough, "
+              << fused->second.rejected() << " points rejected");
+      if(detector_.findLinesInVoxels(fusedVoxels_))
+        detector_.updateLineMap();
+      fusedMaps_.erase(fused);
+    }
 
-      solveLineIds();
+    if(pipeline_)
+    {
+      //the answer to stop has all frames of the scan, otherwise the layers merged so far
+      if(reset)
+        pipeline_->flush();
+      pipelineMap_ = pipeline_->lineMap();
     }
 
     //always add to CAS
-    addToCas(tcas);
+    {
+      rs_refills::ScopedStageTimer timer(profiler_, STAGE_CAS_WRITE);
+      addToCas(tcas);
+    }
 
     //suboptimal but f. it
     if(reset)
     {
-      lines_.clear();
+      detector_.reset();
+      gate_.reset();
+      if(pipeline_)
+      {
+        pipeline_->reset();
+        pipelineMap_.clear();
+      }
       localFrameName_ = "";
     }
     return UIMA_ERR_NONE;
@@ -516,19 +449,26 @@ public:
 
   void drawImageWithLock(cv::Mat &disp)
   {
+    if(frameProcessed_ && !imageLinesFound_ && !rgb_.empty())
+    {
+      detector_.findLinesInImage(rgb_);
+      imageLinesFound_ = true;
+    }
     switch(dispMode)
     {
     case DisplayMode::COLOR:
       disp = rgb_.clone();
+      if(frameProcessed_)
+        drawImageLines(disp);
       break;
     case DisplayMode::EDGE:
-      disp = disp_.clone();
+      disp = detector_.edgeImage().clone();
       break;
     case DisplayMode::BINARY:
-      disp = bin_.clone();
+      disp = detector_.binaryImage().clone();
       break;
     case DisplayMode::GREY:
-      disp = grey_.clone();
+      disp = detector_.greyImage().clone();
       break;
     }
 
@@ -538,22 +478,36 @@ public:
     const std::string &cloudname = "cloud";
     double pointSize = 4.0;
     double pointSize2 = pointSize / 4.0;
+    pcl::PointCloud<pcl::PointXYZRGBA>::Ptr cloud_filtered_ = detector_.lineCloud();
+    pcl::PointCloud<pcl::PointXYZRGBA>::Ptr original_filtered_ = detector_.filteredCloud();
+    const std::vector<pcl::PointIndicesPtr> &line_inliers_ = detector_.lineInliers();
+    const rs_refills::HashVoxelGrid::Sources &sources = detector_.lineSources();
     for(int i = 0; i < line_inliers_.size(); ++i)
     {
       for(int j = 0; j < line_inliers_[i]->indices.size(); ++j)
       {
-        cloud_filtered_->points[line_inliers_[i]->indices[j]].rgba = rs::common::colors[i];
-        cloud_filtered_->points[line_inliers_[i]->indices[j]].a = 255;
+        const int voxel = line_inliers_[i]->indices[j];
+        cloud_filtered_->points[voxel].rgba = rs::common::colors[i];
+        cloud_filtered_->points[voxel].a = 255;
+        //and the pixels of the voxel in the frame
+        for(const int *it = sources.begin(voxel); it != sources.end(voxel); ++it)
+        {
+          original_filtered_->points[*it].rgba = rs::common::colors[i];
+          original_filtered_->points[*it].a = 255;
+        }
       }
     }
 
     int idx = 0;
     visualizer.removeAllShapes();
-    for(auto line : lines_)
+    for(const auto &layer : lineMap().layers())
     {
       std::stringstream lineName;
       lineName << "line_" << idx++;
-      visualizer.addLine(line.pt_begin, line.pt_end, lineName.str());
+      pcl::PointXYZ pt_begin, pt_end;
+      pt_begin.getVector3fMap() = layer.begin.mean;
+      pt_end.getVector3fMap() = layer.end.mean;
+      visualizer.addLine(pt_begin, pt_end, lineName.str());
       visualizer.setShapeRenderingProperties(pcl::visualization::PCL_VISUALIZER_LINE_WIDTH, 4.0, lineName.str());
       visualizer.setShapeRenderingProperties(pcl::visualization::PCL_VISUALIZER_COLOR, 1.0, 0.0, 0.0, lineName.str());
 
@@ -561,7 +515,7 @@ public:
 
     if(firstRun)
     {
-      visualizer.addPointCloud(dispCloud_, "original_filtered");
+      visualizer.addPointCloud(original_filtered_, "original_filtered");
       visualizer.addPointCloud(cloud_filtered_, cloudname);
       visualizer.setPointCloudRenderingProperties(pcl::visualization::PCL_VISUALIZER_POINT_SIZE, pointSize, cloudname);
       visualizer.setPointCloudRenderingProperties(pcl::visualization::PCL_VISUALIZER_POINT_SIZE, pointSize2, "original_filtered");
@@ -569,7 +523,7 @@ public:
     else
     {
 
-      visualizer.updatePointCloud(dispCloud_, "original_filtered");
+      visualizer.updatePointCloud(original_filtered_, "original_filtered");
       visualizer.updatePointCloud(cloud_filtered_, cloudname);//this is very filtered: boundary cloud
       visualizer.getPointCloudRenderingProperties(pcl::visualization::PCL_VISUALIZER_POINT_SIZE, pointSize, cloudname);
       visualizer.getPointCloudRenderingProperties(pcl::visualization::PCL_VISUALIZER_POINT_SIZE, pointSize2, "original_filtered");
@@ -0,0 +1,160 @@
+/**
+ * Micro-benchmark: single pass rs_refills::cropOrganized vs. the chained
+ * x/y/z pcl::PassThrough the annotators used before, and the fused
+ * rs_refills::transformAndCrop vs. pcl::transformPointCloud + crop.
+ *
+ * Usage: crop_box_benchmark [iterations]
+ */
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+
+#include <pcl/point_types.h>
+#include <pcl/filters/passthrough.h>
+#include <pcl/common/transforms.h>
+
+#include <rs_refills/utils/crop_box.h>
+#include <rs_refills/utils/organized_transform.h>
+
+typedef pcl::PointCloud<pcl::PointXYZRGBA> Cloud;
+
+static void makeOrganizedCloud(Cloud &cloud, size_t width, size_t height)
+{
+  std::mt19937 gen(42);
+  std::uniform_real_distribution<float> xy(-0.5f, 1.5f), depth(0.0f, 2.2f), hole(0.0f, 1.0f);
+  cloud.width = width;
+  cloud.height = height;
+  cloud.is_dense = false;
+  cloud.points.resize(width * height);
+  for(auto &p : cloud.points)
+  {
+    if(hole(gen) < 0.1f)
+    {
+      p.x = p.y = p.z = std::numeric_limits<float>::quiet_NaN();
+    }
+    else
+    {
+      p.x = xy(gen);
+      p.y = xy(gen) * 0.3f;
+      p.z = depth(gen);
+    }
+    p.rgba = 0xff808080;
+  }
+}
+
+static void triplePassThrough(const Cloud::Ptr &in, Cloud &out, const rs_refills::CropBox &box)
+{
+  pcl::PassThrough<pcl::PointXYZRGBA> pass;
+  pass.setInputCloud(in);
+  pass.setKeepOrganized(true);
+  pass.setFilterFieldName("x");
+  pass.setFilterLimits(box.minX, box.maxX);
+  pass.filter(out);
+
+  Cloud::Ptr tmp = out.makeShared();
+  pass.setInputCloud(tmp);
+  pass.setFilterFieldName("y");
+  pass.setFilterLimits(box.minY, box.maxY);
+  pass.filter(out);
+
+  tmp = out.makeShared();
+  pass.setInputCloud(tmp);
+  pass.setFilterFieldName("z");
+  pass.setFilterLimits(box.minZ, box.maxZ);
+  pass.filter(out);
+}
+
+int main(int argc, char *argv[])
+{
+  int iterations = argc > 1 ? std::atoi(argv[1]) : 100;
+
+  Cloud::Ptr input(new Cloud);
+  makeOrganizedCloud(*input, 640, 480);
+  //same limits as ShelfDetector::filterCloud
+  rs_refills::CropBox box(0.001, 0.981, -0.04, 0.21, 0.15, 1.95);
+
+  Cloud passOut, fusedOut;
+  std::vector<int> indices;
+
+  auto start = std::chrono::high_resolution_clock::now();
+  for(int i = 0; i < iterations; ++i)
+  {
+    triplePassThrough(input, passOut, box);
+  }
+  double passMs = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count() / iterations;
+
+  start = std::chrono::high_resolution_clock::now();
+  for(int i = 0; i < iterations; ++i)
+  {
+    rs_refills::cropOrganized(*input, fusedOut, box);
+  }
+  double fusedMs = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count() / iterations;
+
+  start = std::chrono::high_resolution_clock::now();
+  for(int i = 0; i < iterations; ++i)
+  {
+    rs_refills::cropIndices(*input, box, indices);
+  }
+  double indicesMs = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count() / iterations;
+
+  Eigen::Affine3f camToWorld = Eigen::Translation3f(0.4f, -0.6f, 1.1f) *
+                               Eigen::AngleAxisf(-M_PI / 2, Eigen::Vector3f::UnitX());
+  rs_refills::CropBox worldBox(0.001, 0.981, -1.2, -0.6, 0.15, 1.95);
+  Cloud transformed, transformedOut;
+
+  start = std::chrono::high_resolution_clock::now();
+  for(int i = 0; i < iterations; ++i)
+  {
+    pcl::transformPointCloud<pcl::PointXYZRGBA>(*input, transformed, camToWorld);
+    rs_refills::cropOrganized(transformed, worldBox);
+  }
+  double transformCropMs = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count() / iterations;
+
+  start = std::chrono::high_resolution_clock::now();
+  for(int i = 0; i < iterations; ++i)
+  {
+    rs_refills::transformAndCrop(*input, transformedOut, camToWorld, worldBox);
+  }
+  double fusedTransformMs = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count() / iterations;
+
+  //force each kernel, levels the CPU does not support fall back to the best available
+  rs_refills::ValidityMask mask;
+  const rs_refills::SimdLevel levels[] = {rs_refills::SimdLevel::SCALAR, rs_refills::SimdLevel::SSE, rs_refills::SimdLevel::AVX2};
+  double levelMs[3];
+  for(int l = 0; l < 3; ++l)
+  {
+    start = std::chrono::high_resolution_clock::now();
+    for(int i = 0; i < iterations; ++i)
+    {
+      rs_refills::transformAndCrop(*input, transformedOut, camToWorld, worldBox, mask, levels[l]);
+    }
+    levelMs[l] = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count() / iterations;
+  }
+
+  size_t mismatches = 0;
+  for(size_t i = 0; i < input->points.size(); ++i)
+  {
+    if(std::isfinite(passOut.points[i].x) != std::isfinite(fusedOut.points[i].x))
+    {
+      ++mismatches;
+    }
+    if(std::isfinite(transformed.points[i].x) != std::isfinite(transformedOut.points[i].x))
+    {
+      ++mismatches;
+    }
+  }
+
+  std::cout << "cloud: " << input->width << "x" << input->height << ", iterations: " << iterations << std::endl
+            << "3x PassThrough : " << passMs << " ms/frame" << std::endl
+            << "cropOrganized  : " << fusedMs << " ms/frame" << std::endl
+            << "cropIndices    : " << indicesMs << " ms/frame (" << indices.size() << " inliers)" << std::endl
+            << "transform + crop: " << transformCropMs << " ms/frame" << std::endl
+            << "transformAndCrop: " << fusedTransformMs << " ms/frame (" << rs_refills::simdLevelName(rs_refills::SimdLevel::AUTO) << ")" << std::endl
+            << "  scalar        : " << levelMs[0] << " ms/frame" << std::endl
+            << "  sse           : " << levelMs[1] << " ms/frame" << std::endl
+            << "  avx2          : " << levelMs[2] << " ms/frame" << std::endl
+            << "mismatching points: " << mismatches << std::endl;
+  return mismatches == 0 ? 0 : 1;
+}
@@ -0,0 +1,533 @@
+/**
+ * Offline replay of recorded frames through the cores of the ShelfDetector
+ * (rs_refills::ShelfLineDetector) and the ProductCounter
+ * (rs_refills::FacingCounter), without ROS, tf or Prolog.
+ *
+ * A recording is a directory with, per frame <name>:
+ *  <name>.pcd          organized PointXYZRGBA cloud in the camera frame
+ *  <name>_normals.pcd  organized normals of the cloud, for the counting
+ *  <name>.png          registered color image (optional)
+ *  <name>.pose         camera pose in the shelf frame: "tx ty tz qx qy qz qw"
+ * and optionally facings.txt, one facing to count in every frame per line:
+ *  "x y z width height depth shelf_type" (separator position, distance to the
+ *  next separator, product height and depth, hanging|standing)
+ *
+ * Frames are loaded before the timing starts, so only the algorithms are measured.
+ * Heap allocations are counted during the last repetition, once the scratch
+ * buffers of the cores are warm, to check the steady state of the hot paths.
+ *
+ * --workers N replays the shelf detection through a rs_refills::ScanPipeline
+ * with N workers, frames are pushed back to back as a camera would.
+ * --fuse N fuses the shelf edges of all frames (rs_refills::FusedShelfMap,
+ * voxels seen in N frames) and extracts the lines once per repetition.
+ * --mode outliers runs the shelf detection once with pcl::StatisticalOutlierRemoval
+ * and once with rs_refills::OrganizedOutlierFilter and compares time, removed
+ * points and shelf layers found.
+ * --mode edges runs the shelf detection once on the 3D edges of the cloud and
+ * once on the segments of the color image and compares time and layers found.
+ * --mode boundaries checks rs_refills::NanBoundaryExtractor on the cropped
+ * frames against a brute force scan of the validity mask and against the NaN
+ * boundaries of pcl::OrganizedEdgeFromNormals it replaces, and times all three.
+ *
+ * Usage: replay_benchmark <directory> [--repeat N] [--mode shelf|count|both|outliers|edges|boundaries] [--workers N] [--fuse N]
+ */
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <new>
+#include <string>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+
+#include <opencv2/highgui/highgui.hpp>
+
+#include <pcl/io/pcd_io.h>
+#include <pcl/features/organized_edge_detection.h>
+
+#include <rs_refills/core/shelf_line_detector.h>
+#include <rs_refills/core/facing_counter.h>
+#include <rs_refills/core/scan_pipeline.h>
+#include <rs_refills/core/fused_shelf_map.h>
+#include <rs_refills/utils/nan_boundary.h>
+#include <rs_refills/utils/stage_profiler.h>
+
+//every heap allocation of the process, including the ones inside PCL and OpenCV
+static std::atomic<uint64_t> heapAllocations(0);
+
+void *operator new(std::size_t size)
+{
+  heapAllocations.fetch_add(1, std::memory_order_relaxed);
+  if(void *p = std::malloc(size ? size : 1))
+    return p;
+  throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept
+{
+  std::free(p);
+}
+
+struct Frame
+{
+  std::string name;
+  rs_refills::ShelfLineDetector::Cloud::Ptr cloud;
+  rs_refills::FacingCounter::Normals::Ptr normals;
+  cv::Mat rgb;
+  Eigen::Affine3f camToWorld;
+};
+
+struct Facing
+{
+  Eigen::Vector3f separator;
+  float width, height, depth;
+  std::string shelfType;
+};
+
+static bool loadPose(const std::string &file, Eigen::Affine3f &pose)
+{
+  std::ifstream in(file.c_str());
+  float tx, ty, tz, qx, qy, qz, qw;
+  if(!(in >> tx >> ty >> tz >> qx >> qy >> qz >> qw))
+    return false;
+  pose = Eigen::Translation3f(tx, ty, tz) * Eigen::Quaternionf(qw, qx, qy, qz).normalized();
+  return true;
+}
+
+static bool loadFrames(const std::string &directory, std::vector<Frame> &frames)
+{
+  namespace fs = boost::filesystem;
+  std::vector<std::string> names;
+  for(fs::directory_iterator it(directory), end; it != end; ++it)
+  {
+    const fs::path &path = it->path();
+    const std::string stem = path.stem().string();
+    if(path.extension() == ".pcd" && stem.size() > 0 &&
+       (stem.size() < 8 || stem.compare(stem.size() - 8, 8, "_normals") != 0))
+      names.push_back(stem);
+  }
+  std::sort(names.begin(), names.end());
+
+  for(const std::string &name : names)
+  {
+    const std::string base = (fs::path(directory) / name).string();
+    Frame frame;
+    frame.name = name;
+    frame.cloud = boost::make_shared<rs_refills::ShelfLineDetector::Cloud>();
+    frame.normals = boost::make_shared<rs_refills::FacingCounter::Normals>();
+    if(pcl::io::loadPCDFile(base + ".pcd", *frame.cloud) != 0 || frame.cloud->height <= 1)
+    {
+      std::cerr << name << ": no organized cloud, skipped" << std::endl;
+      continue;
+    }
+    if(pcl::io::loadPCDFile(base + "_normals.pcd", *frame.normals) != 0 ||
+       frame.normals->points.size() != frame.cloud->points.size())
+    {
+      std::cerr << name << ": no matching normals, skipped" << std::endl;
+      continue;
+    }
+    if(!loadPose(base + ".pose", frame.camToWorld))
+    {
+      std::cerr << name << ": no pose, skipped" << std::endl;
+      continue;
+    }
+    if(fs::exists(base + ".png"))
+      frame.rgb = cv::imread(base + ".png");
+    frames.push_back(frame);
+  }
+  return !frames.empty();
+}
+
+static void loadFacings(const std::string &file, std::vector<Facing> &facings)
+{
+  std::ifstream in(file.c_str());
+  Facing f;
+  while(in >> f.separator[0] >> f.separator[1] >> f.separator[2] >> f.width >> f.height >> f.depth >> f.shelfType)
+    facings.push_back(f);
+}
+
+//SOR vs. the organized filter on the same frames, the crop without outlier removal as reference
+static void compareOutlierFilters(const std::vector<Frame> &frames, int repeat)
+{
+  typedef rs_refills::ShelfLineDetector Detector;
+  Detector reference, sor, organized;
+  Detector::Parameters params = reference.getParameters();
+  params.outlierFilter = Detector::OUTLIER_NONE;
+  reference.setParameters(params);
+  params.outlierFilter = Detector::OUTLIER_SOR;
+  sor.setParameters(params);
+  params.outlierFilter = Detector::OUTLIER_ORGANIZED;
+  organized.setParameters(params);
+
+  uint64_t cropped = 0, removedBySor = 0, removedByOrganized = 0, removedByBoth = 0;
+  for(int r = 0; r < repeat; ++r)
+  {
+    sor.reset();
+    organized.reset();
+    for(const Frame &frame : frames)
+    {
+      sor.process(*frame.cloud, cv::Mat(), frame.camToWorld);
+      organized.process(*frame.cloud, cv::Mat(), frame.camToWorld);
+      if(r > 0)
+        continue;
+      reference.filterCloud(*frame.cloud, frame.camToWorld);
+      const rs_refills::ValidityMask &sorMask = sor.validMask(), &organizedMask = organized.validMask();
+      reference.validMask().forEachValid([&](size_t i)
+      {
+        const bool bySor = !sorMask.test(i), byOrganized = !organizedMask.test(i);
+        ++cropped;
+        removedBySor += bySor;
+        removedByOrganized += byOrganized;
+        removedByBoth += bySor && byOrganized;
+      });
+    }
+  }
+
+  Detector *detectors[] = {&sor, &organized};
+  const char *names[] = {"sor", "organized"};
+  const uint64_t removed[] = {removedBySor, removedByOrganized};
+  std::cout << "frames: " << frames.size() << ", repetitions: " << repeat << ", "
+            << cropped / static_cast<double>(frames.size()) << " points/frame after cropping" << std::endl;
+  for(int d = 0; d < 2; ++d)
+  {
+    const rs_refills::LatencyHistogram &stats = detectors[d]->profiler().histogram(Detector::STAGE_OUTLIERS);
+    std::cout << names[d] << ": " << stats.mean() << " us mean, " << stats.percentile(0.99) << " us p99, "
+              << 100.0 * removed[d] / std::max<uint64_t>(cropped, 1) << "% removed, "
+              << detectors[d]->lineMap().size() << " layers in the last scan" << std::endl;
+  }
+  std::cout << "removed by both: " << removedByBoth << ", sor only: " << removedBySor - removedByBoth
+            << ", organized only: " << removedByOrganized - removedByBoth << ", agreement: "
+            << 100.0 * (cropped - removedBySor - removedByOrganized + 2 * removedByBoth) / std::max<uint64_t>(cropped, 1)
+            << "%" << std::endl;
+}
+
+//shelf lines from the 3D edges vs. from the image segments on the same frames
+static void compareEdgeSources(const std::vector<Frame> &frames, int repeat)
+{
+  typedef rs_refills::ShelfLineDetector Detector;
+  Detector cloud, image;
+  Detector::Parameters params = cloud.getParameters();
+  params.edgeSource = Detector::EDGES_CLOUD;
+  cloud.setParameters(params);
+  params.edgeSource = Detector::EDGES_IMAGE;
+  image.setParameters(params);
+  enum
+  {
+    CLOUD_FRAME,
+    IMAGE_FRAME
+  };
+  rs_refills::StageProfiler frameProfiler({"cloud_edges_frame", "image_edges_frame"});
+
+  size_t withImage = 0, cloudLines = 0, imageLines = 0;
+  for(int r = 0; r < repeat; ++r)
+  {
+    cloud.reset();
+    image.reset();
+    for(const Frame &frame : frames)
+    {
+      //the image is only needed for its lines, the 3D path would not look at it
+      auto start = std::chrono::steady_clock::now();
+      cloud.process(*frame.cloud, cv::Mat(), frame.camToWorld);
+      auto elapsed = std::chrono::steady_clock::now() - start;
+      frameProfiler.record(CLOUD_FRAME, std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count());
+
+      start = std::chrono::steady_clock::now();
+      image.process(*frame.cloud, frame.rgb, frame.camToWorld);
+      elapsed = std::chrono::steady_clock::now() - start;
+      frameProfiler.record(IMAGE_FRAME, std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count());
+
+      if(r > 0)
+        continue;
+      withImage += !frame.rgb.empty();
+      cloudLines += cloud.lineInliers().size();
+      imageLines += image.lineInliers().size();
+    }
+  }
+
+  //layers of the image path that the 3D path found as well
+  size_t matched = 0;
+  for(const rs_refills::ShelfLineMap::Layer &layer : image.lineMap().layers())
+    matched += cloud.lineMap().find(layer.begin.mean, layer.end.mean) >= 0;
+
+  const double n = frames.size();
+  std::cout << "frames: " << frames.size() << " (" << withImage << " with an image, the others fall back to the cloud)"
+            << ", repetitions: " << repeat << std::endl;
+  std::cout << "cloud edges: " << cloudLines / n << " lines/frame, " << cloud.lineMap().size()
+            << " layers in the last scan" << std::endl;
+  std::cout << "image edges: " << imageLines / n << " lines/frame, " << image.lineMap().size()
+            << " layers in the last scan, " << matched << " of them found by the cloud edges as well" << std::endl;
+  std::cout << std::endl << "per frame latencies:" << std::endl << frameProfiler.report();
+  std::cout << std::endl << "image edges stages:" << std::endl << image.profiler().report();
+}
+
+//valid points with an invalid 8-neighbor, outermost rows and columns excluded
+static void bruteForceBoundary(const rs_refills::ValidityMask &valid, int width, int height, std::vector<int> &boundary)
+{
+  boundary.clear();
+  for(int v = 1; v < height - 1; ++v)
+  {
+    for(int u = 1; u < width - 1; ++u)
+    {
+      const int i = v * width + u;
+      if(!valid.test(i))
+        continue;
+      bool invalidNeighbor = false;
+      for(int dv = -1; dv <= 1 && !invalidNeighbor; ++dv)
+        for(int du = -1; du <= 1 && !invalidNeighbor; ++du)
+          invalidNeighbor = !valid.test(i + dv * width + du);
+      if(invalidNeighbor)
+        boundary.push_back(i);
+    }
+  }
+}
+
+//the NaN boundaries on the validity mask vs. a brute force scan and vs. pcl
+static bool compareNanBoundaries(const std::vector<Frame> &frames, int repeat)
+{
+  typedef rs_refills::ShelfLineDetector Detector;
+  Detector detector;
+  Detector::Parameters params = detector.getParameters();
+  params.outlierFilter = Detector::OUTLIER_NONE;
+  detector.setParameters(params);
+  rs_refills::NanBoundaryExtractor extractor;
+  enum
+  {
+    MASK,
+    BRUTE_FORCE,
+    PCL
+  };
+  rs_refills::StageProfiler profiler({"validity_mask", "brute_force", "pcl_edges"});
+
+  std::vector<int> boundary, reference;
+  pcl::PointCloud<pcl::Label> labels;
+  std::vector<pcl::PointIndices> labelIndices;
+  size_t boundaries = 0, bruteForceMismatches = 0, pclMismatches = 0;
+  for(int r = 0; r < repeat; ++r)
+  {
+    for(const Frame &frame : frames)
+    {
+      detector.filterCloud(*frame.cloud, frame.camToWorld);
+      const Detector::Cloud::Ptr cloud = detector.filteredCloud();
+      const rs_refills::ValidityMask &valid = detector.validMask();
+      {
+        rs_refills::ScopedStageTimer timer(profiler, MASK);
+        extractor.extract(valid, cloud->width, cloud->height, boundary);
+      }
+      boundaries += boundary.size();
+
+      {
+        rs_refills::ScopedStageTimer timer(profiler, BRUTE_FORCE);
+        bruteForceBoundary(valid, cloud->width, cloud->height, reference);
+      }
+      bruteForceMismatches += reference != boundary;
+
+      {
+        rs_refills::ScopedStageTimer timer(profiler, PCL);
+        //fresh labels, compute only ORs the edge bits into them
+        labels.points.clear();
+        labelIndices.clear();
+        pcl::OrganizedEdgeFromNormals<pcl::PointXYZRGBA, pcl::Normal, pcl::Label> oed;
+        oed.setInputNormals(frame.normals);
+        oed.setInputCloud(cloud);
+        oed.setDepthDisconThreshold(0.05);
+        oed.setMaxSearchNeighbors(0.03);
+        oed.setEdgeType(oed.EDGELABEL_NAN_BOUNDARY);
+        oed.compute(labels, labelIndices);
+      }
+      pclMismatches += labelIndices.empty() ? !boundary.empty() : labelIndices[0].indices != boundary;
+    }
+  }
+
+  const size_t n = frames.size() * repeat;
+  std::cout << "frames: " << frames.size() << ", repetitions: " << repeat << ", "
+            << boundaries / static_cast<double>(n) << " boundary points/frame" << std::endl;
+  std::cout << "frames differing from the brute force scan: " << bruteForceMismatches
+            << ", from pcl::OrganizedEdgeFromNormals: " << pclMismatches << std::endl;
+  std::cout << std::endl << "per frame latencies:" << std::endl << profiler.report();
+  return bruteForceMismatches == 0 && pclMismatches == 0;
+}
+
+int main(int argc, char *argv[])
+{
+  if(argc < 2)
+  {
+    std::cerr << "Usage: " << argv[0] << " <directory> [--repeat N] [--mode shelf|count|both|outliers|edges|boundaries] [--workers N] [--fuse N]"
+              << std::endl;
+    return 1;
+  }
+  const std::string directory = argv[1];
+  int repeat = 1, workers = 0, fuse = 0;
+  std::string mode = "both";
+  for(int i = 2; i + 1 < argc; i += 2)
+  {
+    const std::string arg = argv[i];
+    if(arg == "--repeat")
+      repeat = std::max(1, std::atoi(argv[i + 1]));
+    else if(arg == "--mode")
+      mode = argv[i + 1];
+    else if(arg == "--workers")
+      workers = std::max(0, std::atoi(argv[i + 1]));
+    else if(arg == "--fuse")
+      fuse = std::max(0, std::atoi(argv[i + 1]));
+    else
+    {
+      std::cerr << "Unknown option " << arg << std::endl;
+      return 1;
+    }
+  }
+  const bool runShelf = mode == "shelf" || mode == "both";
+  const bool runCount = mode == "count" || mode == "both";
+
+  std::vector<Frame> frames;
+  if(!loadFrames(directory, frames))
+  {
+    std::cerr << "No frames found in " << directory << std::endl;
+    return 1;
+  }
+  if(mode == "outliers")
+  {
+    compareOutlierFilters(frames, repeat);
+    return 0;
+  }
+  if(mode == "edges")
+  {
+    compareEdgeSources(frames, repeat);
+    return 0;
+  }
+  if(mode == "boundaries")
+    return compareNanBoundaries(frames, repeat) ? 0 : 1;
+  std::vector<Facing> facings;
+  if(runCount)
+  {
+    loadFacings((boost::filesystem::path(directory) / "facings.txt").string(), facings);
+    if(facings.empty())
+      std::cerr << "No facings.txt, skipping counting" << std::endl;
+  }
+
+  rs_refills::ShelfLineDetector detector;
+  std::unique_ptr<rs_refills::ScanPipeline> pipeline;
+  rs_refills::FusedShelfMap::Parameters fusionParams;
+  fusionParams.minObservations = fuse;
+  rs_refills::FusedShelfMap fused(fusionParams);
+  rs_refills::FusedShelfMap::Cloud fusedVoxels;
+  if(fuse > 0)
+  {
+    rs_refills::ShelfLineDetector::Parameters params = detector.getParameters();
+    params.outlierFilter = rs_refills::ShelfLineDetector::OUTLIER_NONE;
+    detector.setParameters(params);
+  }
+  else if(workers > 0)
+  {
+    rs_refills::ScanPipeline::Parameters params;
+    params.workers = workers;
+    params.dropWhenFull = false;
+    pipeline.reset(new rs_refills::ScanPipeline(params));
+  }
+  rs_refills::FacingCounter counter;
+  enum
+  {
+    SHELF_FRAME,
+    COUNT_FRAME
+  };
+  rs_refills::StageProfiler frameProfiler({"shelf_frame", "count_frame"});
+
+  size_t shelfFrames = 0, countFrames = 0, clusters = 0;
+  uint64_t steadyAllocations = 0;
+  double shelfSeconds = 0, countSeconds = 0;
+  for(int r = 0; r < repeat; ++r)
+  {
+    //every repetition is a new scan
+    detector.reset();
+    if(pipeline)
+      pipeline->reset();
+    fused.clear();
+    const uint64_t allocationsBefore = heapAllocations.load();
+    for(const Frame &frame : frames)
+    {
+      if(runShelf)
+      {
+        auto start = std::chrono::steady_clock::now();
+        //with a pipeline a frame costs the push, the processing shows in the flush below
+        if(pipeline)
+          pipeline->push(*frame.cloud, frame.camToWorld);
+        else if(fuse > 0)
+        {
+          detector.filterCloud(*frame.cloud, frame.camToWorld);
+          if(detector.findEdges())
+            fused.addFrame(*detector.edgeCloud());
+        }
+        else
+          detector.process(*frame.cloud, frame.rgb, frame.camToWorld);
+        auto elapsed = std::chrono::steady_clock::now() - start;
+        frameProfiler.record(SHELF_FRAME, std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count());
+        shelfSeconds += std::chrono::duration<double>(elapsed).count();
+        ++shelfFrames;
+      }
+
+      if(runCount && !facings.empty())
+      {
+        auto start = std::chrono::steady_clock::now();
+        for(const Facing &f : facings)
+        {
+          counter.clear();
+          counter.filterCloud(*frame.cloud, frame.camToWorld,
+                              rs_refills::FacingCounter::facingBox(f.separator, f.width, f.height, f.shelfType));
+          counter.clusterCloud(f.depth, frame.normals);
+          clusters += counter.clusterIndices().size();
+        }
+        auto elapsed = std::chrono::steady_clock::now() - start;
+        frameProfiler.record(COUNT_FRAME, std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count());
+        countSeconds += std::chrono::duration<double>(elapsed).count();
+        ++countFrames;
+      }
+    }
+    if(pipeline)
+    {
+      auto start = std::chrono::steady_clock::now();
+      pipeline->flush();
+      shelfSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+    if(runShelf && fuse > 0)
+    {
+      auto start = std::chrono::steady_clock::now();
+      fused.extract(fusedVoxels);
+      if(detector.findLinesInVoxels(fusedVoxels))
+        detector.updateLineMap();
+      shelfSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+    steadyAllocations = heapAllocations.load() - allocationsBefore;
+  }
+
+  std::cout << "frames: " << frames.size() << ", repetitions: " << repeat << std::endl;
+  if(shelfFrames > 0)
+  {
+    std::cout << "shelf detection: " << shelfFrames / shelfSeconds << " fps, "
+              << (pipeline ? pipeline->lineMap().size() : detector.lineMap().size()) << " layers in the last scan"
+              << (pipeline ? ", pipelined with " + std::to_string(workers) + " workers" : std::string())
+              << (fuse > 0 ? ", fused from " + std::to_string(fusedVoxels.size()) + " voxels" : std::string())
+              << std::endl;
+  }
+  if(countFrames > 0)
+  {
+    std::cout << "counting: " << countFrames / countSeconds << " fps, " << facings.size() << " facings/frame, "
+              << clusters / static_cast<double>(countFrames) << " products/frame" << std::endl;
+  }
+  std::cout << "heap allocations/frame in the last repetition: "
+            << steadyAllocations / static_cast<double>(frames.size()) << " (arenas: "
+            << detector.allocations() << " inlier lists, " << counter.allocations() << " cluster lists)" << std::endl;
+  std::cout << std::endl << "per frame latencies:" << std::endl << frameProfiler.report();
+  if(shelfFrames > 0 && pipeline)
+  {
+    std::cout << std::endl << "ScanPipeline stages:" << std::endl << pipeline->profiler().report();
+    pipeline->mergeDetectorProfilers(detector.profiler());
+  }
+  if(shelfFrames > 0)
+    std::cout << std::endl << "ShelfLineDetector stages:" << std::endl << detector.profiler().report();
+  if(countFrames > 0)
+    std::cout << std::endl << "FacingCounter stages:" << std::endl << counter.profiler().report();
+  return 0;
+}
@@ -0,0 +1,397 @@
+#include <rs_refills/core/facing_counter.h>
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#include <pcl/common/common.h>
+#include <pcl/segmentation/euclidean_cluster_comparator.h>
+#include <pcl/segmentation/organized_connected_component_segmentation.h>
+
+namespace rs_refills
+{
+
+FacingCounter::FacingCounter(StageProfiler *profiler): materialized_(true), profiler_(profiler)
+{
+  cloudFiltered_ = boost::make_shared<Cloud>();
+  source_ = cloudFiltered_;
+  roiCloud_ = boost::make_shared<Cloud>();
+  roiNormals_ = boost::make_shared<Normals>();
+  inputLabels_ = boost::make_shared<pcl::PointCloud<pcl::Label>>();
+  outputLabels_ = boost::make_shared<pcl::PointCloud<pcl::Label>>();
+  ecc_ = boost::make_shared<Comparator>();
+  ignoreLabels_.assign(1, false);
+  if(!profiler_)
+  {
+    ownProfiler_.reset(new StageProfiler({"transform_crop", "refine_crop", "clustering"}));
+    profiler_ = ownProfiler_.get();
+  }
+}
+
+CropBox FacingCounter::facingBox(const Eigen::Vector3f &separator, double width, double depth,
+                                 const std::string &shelfType)
+{
+  float minX, minY, minZ;
+  float maxX, maxY, maxZ;
+
+  if(shelfType == "hanging")
+  {
+    minX = separator.x() - width / 2;
+    maxX = separator.x() + width / 2;
+
+    minY = separator.y() - 0.04;
+    maxY = separator.y() + 0.3;
+
+    maxZ = separator.z();
+    minZ = separator.z() - depth;
+  }
+  else if(shelfType == "standing")
+  {
+    minX = separator.x() + 0.02;
+    maxX = minX + width - 0.04;
+
+    minY = separator.y() - 0.04; //move closer to cam with 2 cm
+    maxY = minY + 0.41; //this can vary between 0.3 and 0.5;
+
+    minZ = separator.z() + 0.015  ; //raise with 2.5 cm
+    maxZ = separator.z() + depth;
+    + 0.02 ; //make sure to get point from the top
+  }
+  else
+  {
+    //nothing is inside
+    minX = minY = minZ = std::numeric_limits<float>::max();
+    maxX = maxY = maxZ = -std::numeric_limits<float>::max();
+  }
+
+  return CropBox(minX, maxX, minY, maxY, minZ, maxZ);
+}
+
+void FacingCounter::filterCloud(const Cloud &cloud, const Eigen::Affine3f &camToWorld, const CropBox &box)
+{
+  //only points that end up inside the facing are transformed and kept
+  ScopedStageTimer timer(*profiler_, STAGE_TRANSFORM_CROP);
+  transformAndCrop(cloud, *cloudFiltered_, camToWorld, box, validMask_);
+  source_ = cloudFiltered_;
+  materialized_ = true;
+}
+
+void FacingCounter::cropCloud(const Cloud::ConstPtr &shelfCloud, const ValidityMask &valid, const CropBox &box)
+{
+  ScopedStageTimer timer(*profiler_, STAGE_TRANSFORM_CROP);
+  //only the mask is computed, the points stay in the shared cloud
+  source_ = shelfCloud;
+  materialized_ = false;
+  //resize cleared the mask
+  validMask_.resize(shelfCloud->points.size());
+  const Cloud::VectorType &points = shelfCloud->points;
+  valid.forEachValid([&](size_t i)
+  {
+    const pcl::PointXYZRGBA &p = points[i];
+    if(box.contains(p.x, p.y, p.z))
+      validMask_.set(i);
+  });
+}
+
+FacingCounter::Cloud::Ptr FacingCounter::filteredCloud()
+{
+  if(!materialized_)
+  {
+    cloudFiltered_->header = source_->header;
+    cloudFiltered_->width = source_->width;
+    cloudFiltered_->height = source_->height;
+    cloudFiltered_->is_dense = false;
+    cloudFiltered_->points.resize(source_->points.size());
+    for(size_t i = 0; i < source_->points.size(); ++i)
+    {
+      pcl::PointXYZRGBA &o = cloudFiltered_->points[i];
+      o = source_->points[i];
+      if(!validMask_.test(i))
+        o.x = o.y = o.z = std::numeric_limits<float>::quiet_NaN();
+    }
+    materialized_ = true;
+  }
+  return cloudFiltered_;
+}
+
+size_t FacingCounter::refineCrop(const CropBox &box)
+{
+  ScopedStageTimer timer(*profiler_, STAGE_REFINE_CROP);
+  size_t kept = 0;
+  for(size_t i = 0; i < source_->points.size(); ++i)
+  {
+    if(!validMask_.test(i))
+      continue;
+    const pcl::PointXYZRGBA &p = source_->points[i];
+    if(box.contains(p.x, p.y, p.z))
+    {
+      ++kept;
+      continue;
+    }
+    validMask_.reset(i);
+    //a copy of the cropped points is only updated if there is one
+    if(materialized_)
+    {
+      pcl::PointXYZRGBA &o = cloudFiltered_->points[i];
+      o.x = o.y = o.z = std::numeric_limits<float>::quiet_NaN();
+    }
+  }
+  return kept;
+}
+
+void FacingCounter::clear()
+{
+  cloudFiltered_->clear();
+  source_ = cloudFiltered_;
+  materialized_ = true;
+  clusterIndices_.clear();
+  clusterBoxes_.clear();
+  indexPool_.reset();
+}
+
+/**
+ * @brief bounds of the cluster in one pass, then every point goes into its
+ *  slice in a second one; replaces getMinMax3D plus a PassThrough (a full
+ *  scan of the cluster) per slice. Boxes get the x/z bounds of the cluster.
+ */
+void FacingCounter::sliceCluster(const Cloud &cloud, const std::vector<int> &cluster, double objDepth,
+                                 ClusterSlices &out)
+{
+  out.min.setConstant(std::numeric_limits<float>::max());
+  out.max.setConstant(-std::numeric_limits<float>::max());
+  for(int idx : cluster)
+  {
+    const Eigen::Vector3f p = cloud.points[idx].getVector3fMap();
+    out.min = out.min.cwiseMin(p);
+    out.max = out.max.cwiseMax(p);
+  }
+
+  const float pdepth = std::abs(out.min[1] - out.max[1]);
+  out.count = objDepth > 0.0 ? static_cast<int>(round(pdepth / objDepth)) : 1;
+
+  BoundingBox bb;
+  bb.minPt.x = out.min[0];
+  bb.minPt.z = out.min[2];
+  bb.maxPt.x = out.max[0];
+  bb.maxPt.z = out.max[2];
+  out.boxes.clear();
+  if(out.count <= 1)
+  {
+    bb.minPt.y = out.min[1];
+    bb.maxPt.y = out.max[1];
+    out.boxes.push_back(bb);
+    return;
+  }
+
+  const float step = pdepth / out.count;
+  out.boxes.resize(out.count, bb);
+  //slice buffers are only ever added, so they keep their capacity
+  if(out.indices.size() < static_cast<size_t>(out.count))
+    out.indices.resize(out.count);
+  for(int j = 0; j < out.count; ++j)
+  {
+    out.boxes[j].minPt.y = out.min[1] + j * step;
+    out.boxes[j].maxPt.y = out.min[1] + (j + 1) * step;
+    out.indices[j].clear();
+    out.indices[j].reserve(cluster.size() / out.count + 1);
+  }
+  const float invStep = 1.0f / step;
+  for(int idx : cluster)
+  {
+    const int j = std::min(out.count - 1, static_cast<int>((cloud.points[idx].y - out.min[1]) * invStep));
+    out.indices[j].push_back(idx);
+  }
+}
+
+void FacingCounter::clusterCloud(double objDepth, const Normals::ConstPtr &normals)
+{
+  ScopedStageTimer timer(*profiler_, STAGE_CLUSTERING);
+  //the crop leaves a small part of the frame, segment only its bounding
+  //rectangle and map the indices back to the full frame afterwards
+  const Cloud &cloud = *source_;
+  const int width = cloud.width;
+  int r0 = std::numeric_limits<int>::max(), c0 = std::numeric_limits<int>::max(), r1 = -1, c1 = -1;
+  validMask_.forEachValid([&](size_t i)
+  {
+    const int r = i / width, c = i % width;
+    r0 = std::min(r0, r);
+    r1 = std::max(r1, r);
+    c0 = std::min(c0, c);
+    c1 = std::max(c1, c);
+  });
+  if(r1 < 0)
+    return;
+  const int roiWidth = c1 - c0 + 1, roiHeight = r1 - r0 + 1;
+  roiCloud_->width = roiNormals_->width = roiWidth;
+  roiCloud_->height = roiNormals_->height = roiHeight;
+  roiCloud_->is_dense = roiNormals_->is_dense = false;
+  roiCloud_->points.resize(roiWidth * roiHeight);
+  roiNormals_->points.resize(roiWidth * roiHeight);
+  for(int r = 0; r < roiHeight; ++r)
+  {
+    const size_t src = (r0 + r) * width + c0, dst = r * roiWidth;
+    std::copy(cloud.points.begin() + src, cloud.points.begin() + src + roiWidth,
+              roiCloud_->points.begin() + dst);
+    std::copy(normals->points.begin() + src, normals->points.begin() + src + roiWidth,
+              roiNormals_->points.begin() + dst);
+    //points of a shared cloud outside of the facing
+    for(int c = 0; c < roiWidth; ++c)
+    {
+      if(!validMask_.test(src + c))
+      {
+        pcl::PointXYZRGBA &p = roiCloud_->points[dst + c];
+        p.x = p.y = p.z = std::numeric_limits<float>::quiet_NaN();
+      }
+    }
+  }
+
+  pcl::Label label;
+  label.label = 0;
+  inputLabels_->height = roiHeight;
+  inputLabels_->width = roiWidth;
+  inputLabels_->points.assign(roiCloud_->points.size(), label);
+
+  ecc_->setInputCloud(roiCloud_);
+  ecc_->setLabels(inputLabels_);
+  ecc_->setExcludeLabels(ignoreLabels_);
+  ecc_->setDistanceThreshold(0.06, true);
+  ecc_->setInputNormals(roiNormals_);
+  //the segmentation appends to the index lists it keeps
+  for(pcl::PointIndices &segment : segments_)
+    segment.indices.clear();
+  pcl::OrganizedConnectedComponentSegmentation<pcl::PointXYZRGBA, pcl::Label> segmenter(ecc_);
+  segmenter.setInputCloud(roiCloud_);
+  //segment only resizes the labels and never writes the NaN points, labels of
+  //the last call would stay; clear keeps the capacity
+  outputLabels_->points.clear();
+  segmenter.segment(*outputLabels_, segments_);
+
+  //keep the big segments at the front, back to indices of the full frame
+  size_t numSegments = 0;
+  for(size_t i = 0; i < segments_.size(); ++i)
+  {
+    if(segments_[i].indices.size() < 600)
+      continue;
+    segments_[numSegments].indices.swap(segments_[i].indices);
+    for(int &idx : segments_[numSegments].indices)
+      idx = (r0 + idx / roiWidth) * width + c0 + idx % roiWidth;
+    ++numSegments;
+  }
+
+  //if two clusters in the same y range; merged clusters keep running sums,
+  //so comparing against one is O(1), and their index lists are only built
+  //once all clusters are assigned
+  size_t numMerged = 0;
+  for(size_t i = 0; i < numSegments; ++i)
+  {
+    Eigen::Vector3d sum = Eigen::Vector3d::Zero();
+    size_t count = 0;
+    for(int idx : segments_[i].indices)
+    {
+      const pcl::PointXYZRGBA &p = cloud.points[idx];
+      if(!pcl::isFinite(p))
+        continue;
+      sum += p.getVector3fMap().cast<double>();
+      ++count;
+    }
+    const double c1 = count > 0 ? sum[1] / count : 0.0;
+
+    bool isMerged = false;
+    for(size_t j = 0; j < numMerged; ++j)
+    {
+      MergedCluster &m = merged_[j];
+      const double c2 = m.count > 0 ? m.sum[1] / m.count : 0.0;
+      if(std::abs(c1 - c2) < objDepth)
+      {
+        m.sum += sum;
+        m.count += count;
+        m.size += segments_[i].indices.size();
+        m.members.push_back(i);
+        isMerged = true;
+        break;
+      }
+    }
+    if(!isMerged)
+    {
+      if(merged_.size() == numMerged)
+        merged_.push_back(MergedCluster());
+      MergedCluster &m = merged_[numMerged++];
+      m.sum = sum;
+      m.count = count;
+      m.size = segments_[i].indices.size();
+      m.members.clear();
+      m.members.push_back(i);
+    }
+  }
+
+  if(mergedIndices_.size() < numMerged)
+    mergedIndices_.resize(numMerged);
+  for(size_t j = 0; j < numMerged; ++j)
+  {
+    std::vector<int> &indices = mergedIndices_[j];
+    if(merged_[j].members.size() == 1)
+    {
+      indices.swap(segments_[merged_[j].members[0]].indices);
+      continue;
+    }
+    indices.clear();
+    indices.reserve(merged_[j].size);
+    for(int i : merged_[j].members)
+      indices.insert(indices.end(), segments_[i].indices.begin(), segments_[i].indices.end());
+  }
+
+  //clusters are split independently, results are collected in cluster order
+  if(slices_.size() < numMerged)
+    slices_.resize(numMerged);
+  #pragma omp parallel for schedule(dynamic)
+  for(int i = 0; i < static_cast<int>(numMerged); ++i)
+  {
+    sliceCluster(cloud, mergedIndices_[i], objDepth, slices_[i]);
+  }
+
+  float gminX = std::numeric_limits<float>::max(),
+        gminZ = std::numeric_limits<float>::max(),
+        gmaxX = std::numeric_limits<float>::min(),
+        gmaxZ = std::numeric_limits<float>::min();
+  for(size_t i = 0; i < numMerged; ++i)
+  {
+    ClusterSlices &cs = slices_[i];
+    if(cs.max[0] > gmaxX) gmaxX = cs.max[0];
+    if(cs.max[2] > gmaxZ) gmaxZ = cs.max[2];
+    if(cs.min[0] < gminX) gminX = cs.min[0];
+    if(cs.min[2] < gminZ) gminZ = cs.min[2];
+
+    //results swap buffers with the arena, nothing is copied or allocated once it is warm
+    if(cs.count <= 1)
+    {
+      clusterBoxes_.push_back(cs.boxes[0]);
+      pcl::PointIndicesPtr cluster = indexPool_.acquire();
+      cluster->indices.swap(mergedIndices_[i]);
+      clusterIndices_.push_back(cluster);
+    }
+    else
+    {
+      for(int j = 0; j < cs.count; ++j)
+      {
+        clusterBoxes_.push_back(cs.boxes[j]);
+        if(cs.indices[j].size() > 100) //nois level?
+        {
+          pcl::PointIndicesPtr cluster = indexPool_.acquire();
+          cluster->indices.swap(cs.indices[j]);
+          clusterIndices_.push_back(cluster);
+        }
+      }
+    }
+  }
+
+  //overwrite all dimensions with biggest BB;
+  for(auto &bb : clusterBoxes_)
+  {
+    bb.maxPt.x = gmaxX;
+    bb.maxPt.z = gmaxZ;
+    bb.minPt.x = gminX;
+    bb.minPt.z = gminZ;
+  }
+}
+
+}
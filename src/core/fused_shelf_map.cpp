@@ -0,0 +1,95 @@
+#include <rs_refills/core/fused_shelf_map.h>
+
+#include <cmath>
+
+namespace rs_refills
+{
+
+FusedShelfMap::FusedShelfMap(const Parameters &params): params_(params), frames_(0), rejected_(0)
+{
+}
+
+uint64_t FusedShelfMap::key(const Eigen::Vector3f &p) const
+{
+  return HashVoxelGrid::key(p, params_.leafSize);
+}
+
+void FusedShelfMap::evict()
+{
+  for(auto it = voxels_.begin(); it != voxels_.end();)
+  {
+    if(it->second.observations == 1 && it->second.lastFrame != frames_)
+      it = voxels_.erase(it);
+    else
+      ++it;
+  }
+}
+
+void FusedShelfMap::addFrame(const Cloud &edges)
+{
+  ++frames_;
+  bool evicted = false;
+  for(const pcl::PointXYZRGBA &pt : edges.points)
+  {
+    if(!std::isfinite(pt.x) || !std::isfinite(pt.y) || !std::isfinite(pt.z))
+      continue;
+    const Eigen::Vector3f p = pt.getVector3fMap();
+    const uint64_t k = key(p);
+    auto it = voxels_.find(k);
+    if(it == voxels_.end())
+    {
+      //evict once per frame, it is a pass over the whole map
+      if(voxels_.size() >= params_.maxVoxels && !evicted)
+      {
+        evict();
+        evicted = true;
+      }
+      if(voxels_.size() >= params_.maxVoxels)
+      {
+        ++rejected_;
+        continue;
+      }
+      Voxel &v = voxels_[k];
+      v.sum = p;
+      v.points = 1;
+      v.observations = 1;
+      v.lastFrame = frames_;
+      continue;
+    }
+    Voxel &v = it->second;
+    v.sum += p;
+    ++v.points;
+    if(v.lastFrame != frames_)
+    {
+      ++v.observations;
+      v.lastFrame = frames_;
+    }
+  }
+}
+
+void FusedShelfMap::extract(Cloud &voxels) const
+{
+  voxels.clear();
+  voxels.points.reserve(voxels_.size());
+  for(const auto &e : voxels_)
+  {
+    const Voxel &v = e.second;
+    if(v.observations < static_cast<uint32_t>(params_.minObservations))
+      continue;
+    pcl::PointXYZRGBA pt;
+    pt.getVector3fMap() = v.sum / v.points;
+    voxels.points.push_back(pt);
+  }
+  voxels.width = voxels.points.size();
+  voxels.height = 1;
+  voxels.is_dense = true;
+}
+
+void FusedShelfMap::clear()
+{
+  voxels_.clear();
+  frames_ = 0;
+  rejected_ = 0;
+}
+
+}
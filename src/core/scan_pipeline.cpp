@@ -0,0 +1,158 @@
+#include <rs_refills/core/scan_pipeline.h>
+
+#include <algorithm>
+
+namespace rs_refills
+{
+
+ScanPipeline::ScanPipeline(const Parameters &params): params_(params), pushed_(0), taken_(0), merged_(0),
+  dropped_(0), stop_(false), profiler_({"extraction", "merge", "frame_latency"})
+{
+  params_.workers = std::max(1, params_.workers);
+  params_.capacity = std::max<size_t>(1, params_.capacity);
+  slots_.resize(params_.capacity);
+  for(Slot &slot : slots_)
+  {
+    slot.cloud = boost::make_shared<Cloud>();
+    slot.done = false;
+  }
+  for(int i = 0; i < params_.workers; ++i)
+  {
+    detectors_.emplace_back(new ShelfLineDetector());
+    detectors_.back()->setParameters(params_.detector);
+  }
+  for(auto &detector : detectors_)
+    threads_.emplace_back(&ScanPipeline::work, this, std::ref(*detector));
+  threads_.emplace_back(&ScanPipeline::merge, this);
+}
+
+ScanPipeline::~ScanPipeline()
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  frameQueued_.notify_all();
+  frameDone_.notify_all();
+  frameMerged_.notify_all();
+  for(std::thread &t : threads_)
+    t.join();
+}
+
+bool ScanPipeline::push(const Cloud &cloud, const Eigen::Affine3f &camToWorld)
+{
+  std::unique_lock<std::mutex> lock(mutex_);
+  if(pushed_ - merged_ == slots_.size())
+  {
+    if(params_.dropWhenFull)
+    {
+      ++dropped_;
+      return false;
+    }
+    frameMerged_.wait(lock, [this] { return stop_ || pushed_ - merged_ < slots_.size(); });
+    if(stop_)
+      return false;
+  }
+  //the slot is free until pushed_ is increased, copy without holding the lock
+  Slot &slot = slots_[pushed_ % slots_.size()];
+  lock.unlock();
+  *slot.cloud = cloud;
+  slot.camToWorld = camToWorld;
+  slot.pushed = std::chrono::steady_clock::now();
+  lock.lock();
+  ++pushed_;
+  lock.unlock();
+  frameQueued_.notify_one();
+  return true;
+}
+
+void ScanPipeline::flush()
+{
+  std::unique_lock<std::mutex> lock(mutex_);
+  frameMerged_.wait(lock, [this] { return stop_ || merged_ == pushed_; });
+}
+
+void ScanPipeline::reset()
+{
+  flush();
+  std::lock_guard<std::mutex> lock(mapMutex_);
+  lineMap_.clear();
+}
+
+void ScanPipeline::mergeDetectorProfilers(StageProfiler &profiler) const
+{
+  for(const auto &detector : detectors_)
+    profiler.merge(detector->profiler());
+}
+
+ShelfLineMap ScanPipeline::lineMap() const
+{
+  std::lock_guard<std::mutex> lock(mapMutex_);
+  return lineMap_;
+}
+
+uint64_t ScanPipeline::merged() const
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  return merged_;
+}
+
+uint64_t ScanPipeline::dropped() const
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  return dropped_;
+}
+
+void ScanPipeline::work(ShelfLineDetector &detector)
+{
+  std::unique_lock<std::mutex> lock(mutex_);
+  while(true)
+  {
+    frameQueued_.wait(lock, [this] { return stop_ || taken_ < pushed_; });
+    if(stop_)
+      return;
+    Slot &slot = slots_[taken_++ % slots_.size()];
+    lock.unlock();
+
+    {
+      ScopedStageTimer timer(profiler_, STAGE_EXTRACTION);
+      detector.filterCloud(*slot.cloud, slot.camToWorld);
+      if(detector.findLinesInCloud())
+        detector.lineObservations(slot.observations);
+      else
+        slot.observations.clear();
+    }
+
+    lock.lock();
+    slot.done = true;
+    frameDone_.notify_one();
+  }
+}
+
+void ScanPipeline::merge()
+{
+  std::unique_lock<std::mutex> lock(mutex_);
+  while(true)
+  {
+    frameDone_.wait(lock, [this] { return stop_ || (merged_ < taken_ && slots_[merged_ % slots_.size()].done); });
+    if(stop_)
+      return;
+    Slot &slot = slots_[merged_ % slots_.size()];
+    lock.unlock();
+
+    {
+      ScopedStageTimer timer(profiler_, STAGE_MERGE);
+      std::lock_guard<std::mutex> mapLock(mapMutex_);
+      ShelfLineDetector::updateLineMap(lineMap_, slot.observations, params_.detector.maxShelfHeight);
+    }
+    profiler_.record(STAGE_FRAME_LATENCY, std::chrono::duration_cast<std::chrono::microseconds>(
+                       std::chrono::steady_clock::now() - slot.pushed).count());
+
+    lock.lock();
+    slot.done = false;
+    ++merged_;
+    frameMerged_.notify_all();
+  }
+}
+
+}
@@ -0,0 +1,408 @@
+#include <rs_refills/core/shelf_line_detector.h>
+
+#include <algorithm>
+#include <cmath>
+
+#include <opencv2/imgproc/imgproc.hpp>
+
+#include <pcl/filters/statistical_outlier_removal.h>
+#include <pcl/filters/extract_indices.h>
+
+namespace rs_refills
+{
+
+ShelfLineDetector::ShelfLineDetector():
+  profiler_({"transform_crop", "outlier_removal", "image_lines", "image_lift", "edge_detection", "voxelization", "ransac", "line_map"})
+{
+  cloudFiltered_ = boost::make_shared<Cloud>();
+  edgeCloud_ = boost::make_shared<Cloud>();
+  lineCloud_ = boost::make_shared<Cloud>();
+  edgeIndices_ = boost::make_shared<pcl::PointIndices>();
+  lineExtractor_.setParameters(params_.lineExtraction);
+  outlierFilter_.setParameters(params_.organizedOutliers);
+}
+
+void ShelfLineDetector::setParameters(const Parameters &params)
+{
+  params_ = params;
+  lineExtractor_.setParameters(params_.lineExtraction);
+  outlierFilter_.setParameters(params_.organizedOutliers);
+}
+
+void ShelfLineDetector::filterCloud(const Cloud &cloud, const Eigen::Affine3f &camToWorld)
+{
+  {
+    ScopedStageTimer timer(profiler_, STAGE_TRANSFORM_CROP);
+    transformAndCrop(cloud, *cloudFiltered_, camToWorld, params_.shelfMeter, validMask_);
+  }
+
+  //scans fused over many frames get rid of the noise by the number of observations
+  if(params_.outlierFilter == OUTLIER_ORGANIZED)
+  {
+    ScopedStageTimer timer(profiler_, STAGE_OUTLIERS);
+    outlierFilter_.filter(*cloudFiltered_, validMask_);
+  }
+  else if(params_.outlierFilter == OUTLIER_SOR)
+  {
+    ScopedStageTimer timer(profiler_, STAGE_OUTLIERS);
+    pcl::StatisticalOutlierRemoval<pcl::PointXYZRGBA> sor(true);
+    sor.setInputCloud(cloudFiltered_);
+    sor.setKeepOrganized(true);
+    sor.setMeanK(30);
+    sor.setStddevMulThresh(0.5);
+    sor.filter(*cloudFiltered_);
+    for(int idx : *sor.getRemovedIndices())
+      validMask_.reset(idx);
+  }
+}
+
+void ShelfLineDetector::findLinesInImage(const cv::Mat &rgb)
+{
+  ScopedStageTimer timer(profiler_, STAGE_IMAGE_LINES);
+  //masking the grey image is the same as masking the color image, without a copy of it
+  cv::cvtColor(rgb, grey_, cv::COLOR_BGR2GRAY);
+  uchar *pixels = grey_.ptr<uchar>();
+  validMask_.forEachInvalid([pixels](size_t i)
+  {
+    pixels[i] = 0;
+  });
+
+  cv::Mat edge;
+
+  cv::threshold(grey_, bin_, 150, 255, cv::THRESH_BINARY);
+  cv::Canny(bin_, edge, 50, 150);
+  cv::Mat element = getStructuringElement(cv::MORPH_CROSS,
+                                          cv::Size(3, 3),
+                                          cv::Point(2, 2));
+  cv::dilate(edge, edges_, element);
+
+  imageLines_.clear();
+  cv::HoughLinesP(edges_, imageLines_, 1, CV_PI / 180, 50, 400, 15);
+}
+
+bool ShelfLineDetector::detectEdges()
+{
+  //a NaN boundary only depends on which points are valid
+  return nanBoundary_.extract(validMask_, cloudFiltered_->width, cloudFiltered_->height, edgeIndices_->indices) > 0;
+}
+
+bool ShelfLineDetector::findEdges()
+{
+  edgeCloud_->clear();
+  ScopedStageTimer timer(profiler_, STAGE_EDGE_DETECTION);
+  if(!detectEdges())
+    return false;
+
+  pcl::ExtractIndices<pcl::PointXYZRGBA> ei;
+  ei.setInputCloud(cloudFiltered_);
+  //this is the bullshit of PCL...one algo returns PointIndices next algo want a f'in pointer;
+  ei.setIndices(edgeIndices_);
+  //only the edges, the filtered cloud stays as it is for display
+  ei.filter(*edgeCloud_);
+  return true;
+}
+
+void ShelfLineDetector::clearLines()
+{
+  lineInliers_.clear();
+  inlierPool_.reset();
+  lineModels_.clear();
+  lineCloud_->clear();
+  lineSources_.clear();
+}
+
+bool ShelfLineDetector::findLinesInCloud()
+{
+  clearLines();
+  {
+    ScopedStageTimer timer(profiler_, STAGE_EDGE_DETECTION);
+    if(!detectEdges())
+      return false;
+  }
+
+  {
+    //straight from the organized cloud, the edges need not be extracted
+    ScopedStageTimer timer(profiler_, STAGE_VOXELIZATION);
+    voxelGrid_.voxelize(*cloudFiltered_, edgeIndices_->indices, *lineCloud_, lineSources_);
+  }
+  extractLines();
+  return true;
+}
+
+bool ShelfLineDetector::findLinesFromImage(const cv::Mat &rgb)
+{
+  clearLines();
+  //the pixels of the segments index the organized cloud
+  if(rgb.empty() || rgb.cols != static_cast<int>(cloudFiltered_->width) ||
+     rgb.rows != static_cast<int>(cloudFiltered_->height))
+  {
+    imageLines_.clear();
+    return false;
+  }
+  findLinesInImage(rgb);
+
+  ScopedStageTimer timer(profiler_, STAGE_IMAGE_LIFT);
+  const float distanceThreshold = params_.lineExtraction.distanceThreshold;
+  const size_t minInliers = params_.minLineInliers + 1;
+  const int width = cloudFiltered_->width, height = cloudFiltered_->height;
+  imageCandidates_.clear();
+  for(const cv::Vec4i &l : imageLines_)
+  {
+    //the segments lie on the boundary of the mask, the valid points are next to them
+    //one band per column: the pixels of a steep segment in the same column
+    //would have overlapping bands and lift the same points more than once
+    liftedPixels_.clear();
+    auto liftColumn = [&](int u, int top, int bottom)
+    {
+      const int v0 = std::max(0, top - params_.imageBandRadius);
+      const int v1 = std::min(height - 1, bottom + params_.imageBandRadius);
+      for(int v = v0; v <= v1; ++v)
+      {
+        const int i = v * width + u;
+        if(validMask_.test(i))
+          liftedPixels_.push_back(i);
+      }
+    };
+    cv::LineIterator it(grey_, cv::Point(l[0], l[1]), cv::Point(l[2], l[3]), 8);
+    //the iterator visits the pixels of a column one after the other
+    int column = -1, top = 0, bottom = 0;
+    for(int n = 0; n < it.count; ++n, ++it)
+    {
+      const cv::Point p = it.pos();
+      if(p.x != column)
+      {
+        if(column >= 0)
+          liftColumn(column, top, bottom);
+        column = p.x;
+        top = bottom = p.y;
+      }
+      top = std::min(top, p.y);
+      bottom = std::max(bottom, p.y);
+    }
+    if(column >= 0)
+      liftColumn(column, top, bottom);
+    if(liftedPixels_.size() < minInliers)
+      continue;
+
+    //voxels of each segment of their own, same as the voxel grid on the cloud edges
+    const size_t first = lineCloud_->points.size();
+    voxelGrid_.voxelize(*cloudFiltered_, liftedPixels_, *lineCloud_, lineSources_);
+    const size_t last = lineCloud_->points.size();
+    if(last - first < minInliers)
+      continue;
+
+    //start parallel to x at the median height, then refit to the voxels within the RANSAC
+    //distance of the line in XZ and select again until the inliers settle
+    heights_.clear();
+    for(size_t k = first; k < last; ++k)
+      heights_.push_back(lineCloud_->points[k].z);
+    std::nth_element(heights_.begin(), heights_.begin() + heights_.size() / 2, heights_.end());
+    Eigen::Vector3f mean(0, 0, heights_[heights_.size() / 2]);
+    float slope = 0;
+    pcl::PointIndicesPtr inliers = inlierPool_.acquire();
+    size_t previous = 0;
+    for(int refinement = 0; refinement < 5; ++refinement)
+    {
+      const Eigen::Vector2f dir = Eigen::Vector2f(1, slope).normalized();
+      inliers->indices.clear();
+      for(size_t k = first; k < last; ++k)
+      {
+        const pcl::PointXYZRGBA &p = lineCloud_->points[k];
+        if(std::abs((p.x - mean.x()) * dir[1] - (p.z - mean.z()) * dir[0]) <= distanceThreshold)
+          inliers->indices.push_back(k);
+      }
+      if(inliers->indices.size() < minInliers || inliers->indices.size() == previous)
+        break;
+      previous = inliers->indices.size();
+
+      mean.setZero();
+      for(int k : inliers->indices)
+        mean += lineCloud_->points[k].getVector3fMap();
+      mean /= inliers->indices.size();
+      float sxx = 0, sxz = 0;
+      for(int k : inliers->indices)
+      {
+        const Eigen::Vector3f d = lineCloud_->points[k].getVector3fMap() - mean;
+        sxx += d.x() * d.x();
+        sxz += d.x() * d.z();
+      }
+      slope = sxx > 0 ? sxz / sxx : 0;
+    }
+    if(inliers->indices.size() < minInliers)
+      continue;
+
+    //the variance on y needs to be small, the line parallel to the x axis
+    float ssd = 0;
+    for(int k : inliers->indices)
+    {
+      const float d = lineCloud_->points[k].y - mean.y();
+      ssd += d * d;
+    }
+    if(std::sqrt(ssd / inliers->indices.size()) >= params_.maxVariance ||
+       std::atan(std::abs(slope)) > params_.lineExtraction.epsAngle)
+      continue;
+
+    ImageLine line;
+    line.inliers = inliers;
+    line.model.resize(6);
+    line.model << mean, Eigen::Vector3f(1, 0, slope).normalized();
+    imageCandidates_.push_back(line);
+  }
+
+  //Hough returns the same edge several times, keep the best supported one
+  std::sort(imageCandidates_.begin(), imageCandidates_.end(), [](const ImageLine &a, const ImageLine &b)
+  {
+    return a.inliers->indices.size() > b.inliers->indices.size();
+  });
+  for(const ImageLine &line : imageCandidates_)
+  {
+    if(static_cast<int>(lineInliers_.size()) >= params_.maxLines)
+      break;
+    bool duplicate = false;
+    for(const Eigen::VectorXf &model : lineModels_)
+    {
+      if(std::abs(model[1] - line.model[1]) < distanceThreshold && std::abs(model[2] - line.model[2]) < distanceThreshold)
+      {
+        duplicate = true;
+        break;
+      }
+    }
+    if(duplicate)
+      continue;
+    lineModels_.push_back(line.model);
+    lineInliers_.push_back(line.inliers);
+  }
+  return !lineInliers_.empty();
+}
+
+bool ShelfLineDetector::findLinesInVoxels(const Cloud &voxels)
+{
+  clearLines();
+  *lineCloud_ = voxels;
+  //voxels of their own, nothing of the filtered cloud in them
+  lineSources_.start.assign(voxels.size() + 1, 0);
+  extractLines();
+  return !lineInliers_.empty();
+}
+
+void ShelfLineDetector::extractLines()
+{
+  ScopedStageTimer timer(profiler_, STAGE_RANSAC);
+  //one index over the XZ projection of the edges for all lines of this frame;
+  //lines parallel to the X-AXES (THIS CAN CHANGE)
+  lineExtractor_.setInputCloud(*lineCloud_);
+
+  //every round accepts all non overlapping lines that have enough inliers;
+  //stop once a round finds none, maxLines is only a safety net
+  int count = 0;
+  std::vector<std::vector<int>> roundInliers;
+  std::vector<Eigen::VectorXf> roundModels;
+  while(count < params_.maxLines && lineExtractor_.findLines(roundInliers, roundModels, params_.minLineInliers + 1) > 0)
+  {
+    for(size_t i = 0; i < roundInliers.size() && count < params_.maxLines; ++i, ++count)
+    {
+      const std::vector<int> &inliers = roundInliers[i];
+
+      float avg_y = 0;
+      std::for_each(inliers.begin(), inliers.end(), [&avg_y, this](int n)
+      {
+        avg_y += this->lineCloud_->points[n].y;
+      }
+                   );
+      avg_y = avg_y / inliers.size();
+      float ssd = 0;
+      std::for_each(inliers.begin(), inliers.end(), [avg_y, &ssd, this](int n)
+      {
+        ssd += (this->lineCloud_->points[n].y - avg_y) * (this->lineCloud_->points[n].y - avg_y);
+      }
+                   );
+
+      float var = std::sqrt(ssd / (inliers.size()));
+
+      //the variance on y needs to be small
+      if(var < params_.maxVariance)
+      {
+        lineModels_.push_back(roundModels[i]);
+        pcl::PointIndicesPtr lineInliers = inlierPool_.acquire();
+        lineInliers->indices.assign(inliers.begin(), inliers.end());
+        lineInliers_.push_back(lineInliers);
+      }
+      lineExtractor_.removePoints(inliers);
+    }
+  }
+}
+
+void ShelfLineDetector::lineObservations(std::vector<LineObservation> &observations) const
+{
+  observations.clear();
+  for(auto inliers : lineInliers_)
+  {
+    pcl::PointXYZRGBA pt_begin = lineCloud_->points[inliers->indices[0]];
+    pcl::PointXYZRGBA pt_end = pt_begin;
+    std::for_each(inliers->indices.begin() + 1, inliers->indices.end(), [&pt_begin, &pt_end, this](int n)
+    {
+      if(this->lineCloud_->points[n].x < pt_begin.x)
+      {
+        pt_begin = this->lineCloud_->points[n];
+      }
+
+      if(this->lineCloud_->points[n].x > pt_end.x)
+      {
+        pt_end = this->lineCloud_->points[n];
+      }
+    });
+
+    //observations are weighted by their support
+    LineObservation observation;
+    observation.begin = pt_begin.getVector3fMap();
+    observation.end = pt_end.getVector3fMap();
+    observation.weight = inliers->indices.size();
+    observations.push_back(observation);
+  }
+}
+
+void ShelfLineDetector::updateLineMap(ShelfLineMap &lineMap, const std::vector<LineObservation> &observations,
+                                      float maxShelfHeight)
+{
+  for(const LineObservation &o : observations)
+  {
+    int id = lineMap.find(o.begin, o.end);
+    if(id >= 0)
+    {
+      lineMap.update(id, o.begin, o.end, o.weight);
+    }
+    else if(o.begin.z() < maxShelfHeight)
+    {
+      lineMap.insert(o.begin, o.end, o.weight);
+    }
+  }
+}
+
+void ShelfLineDetector::updateLineMap()
+{
+  ScopedStageTimer timer(profiler_, STAGE_LINE_MAP);
+  lineObservations(observations_);
+  updateLineMap(lineMap_, observations_, params_.maxShelfHeight);
+}
+
+bool ShelfLineDetector::process(const Cloud &cloud, const cv::Mat &rgb, const Eigen::Affine3f &camToWorld)
+{
+  filterCloud(cloud, camToWorld);
+  if(params_.edgeSource == EDGES_IMAGE && !rgb.empty())
+  {
+    //without any segment the lighting is off, the cloud still has the edges
+    if(!findLinesFromImage(rgb) && (!imageLines_.empty() || !findLinesInCloud()))
+      return false;
+  }
+  else
+  {
+    if(!rgb.empty())
+      findLinesInImage(rgb);
+    if(!findLinesInCloud())
+      return false;
+  }
+  updateLineMap();
+  return true;
+}
+
+}
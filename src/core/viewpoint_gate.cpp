@@ -0,0 +1,82 @@
+#include <rs_refills/core/viewpoint_gate.h>
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+namespace rs_refills
+{
+
+bool ViewpointGate::visibleRegion(const Eigen::Affine3f &camToWorld, const CameraIntrinsics &intrinsics, int width,
+                                  int height, float planeY, Region &region)
+{
+  if(!intrinsics.valid() || width <= 0 || height <= 0)
+    return false;
+
+  region.minX = region.minZ = std::numeric_limits<float>::max();
+  region.maxX = region.maxZ = -std::numeric_limits<float>::max();
+  const Eigen::Vector3f origin = camToWorld.translation();
+  const float us[2] = {0.0f, static_cast<float>(width)}, vs[2] = {0.0f, static_cast<float>(height)};
+  for(float u : us)
+  {
+    for(float v : vs)
+    {
+      //inverse of CameraIntrinsics::project at depth 1
+      const float y = (v - intrinsics.cy) / intrinsics.fy;
+      const float x = (u - intrinsics.cx - intrinsics.skew * y) / intrinsics.fx;
+      const Eigen::Vector3f ray = camToWorld.linear() * Eigen::Vector3f(x, y, 1.0f);
+      if(std::abs(ray.y()) < 1e-6f)
+        return false;
+      const float t = (planeY - origin.y()) / ray.y();
+      if(t <= 0.0f)
+        return false;
+      const Eigen::Vector3f hit = origin + t * ray;
+      region.minX = std::min(region.minX, hit.x());
+      region.maxX = std::max(region.maxX, hit.x());
+      region.minZ = std::min(region.minZ, hit.z());
+      region.maxZ = std::max(region.maxZ, hit.z());
+    }
+  }
+  return region.area() > 0.0f;
+}
+
+bool ViewpointGate::wouldAccept(const Eigen::Affine3f &camToWorld, const CameraIntrinsics &intrinsics, int width,
+                                int height)
+{
+  hasPending_ = false;
+  View view;
+  if(params_.maxOverlap >= 1.0f ||
+     !visibleRegion(camToWorld, intrinsics, width, height, params_.shelfPlaneY, view.region))
+  {
+    //nothing to compare with, better process it
+    return true;
+  }
+  view.direction = camToWorld.linear().col(2).normalized();
+
+  const float minCos = std::cos(params_.maxRotation);
+  for(const View &seen : views_)
+  {
+    if(view.direction.dot(seen.direction) < minCos)
+      continue;
+    const float overlapX = std::min(view.region.maxX, seen.region.maxX) - std::max(view.region.minX, seen.region.minX);
+    const float overlapZ = std::min(view.region.maxZ, seen.region.maxZ) - std::max(view.region.minZ, seen.region.minZ);
+    if(overlapX > 0.0f && overlapZ > 0.0f && overlapX * overlapZ > params_.maxOverlap * view.region.area())
+    {
+      ++skipped_;
+      return false;
+    }
+  }
+  pending_ = view;
+  hasPending_ = true;
+  return true;
+}
+
+void ViewpointGate::commit()
+{
+  if(hasPending_)
+    views_.push_back(pending_);
+  hasPending_ = false;
+  ++accepted_;
+}
+
+}
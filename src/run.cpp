@@ -76,6 +76,7 @@ public:
       newPipelineOrder.push_back("NormalEstimator");
       newPipelineOrder.push_back("ShelfDetector");
     }
+    //a batch detect query ("facings") runs this pipeline once, ProductCounter counts all facings on that frame
     if(queryType == QueryInterface::QueryType::DETECT)
     {
       newPipelineOrder.clear();
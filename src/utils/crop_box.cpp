@@ -0,0 +1,74 @@
+#include <rs_refills/utils/crop_box.h>
+
+namespace rs_refills
+{
+
+size_t cropOrganized(pcl::PointCloud<pcl::PointXYZRGBA> &cloud, const CropBox &box)
+{
+  const float nan = std::numeric_limits<float>::quiet_NaN();
+  size_t kept = 0;
+  for(auto &p : cloud.points)
+  {
+    if(box.contains(p.x, p.y, p.z))
+    {
+      ++kept;
+    }
+    else
+    {
+      p.x = p.y = p.z = nan;
+    }
+  }
+  cloud.is_dense = kept == cloud.points.size();
+  return kept;
+}
+
+size_t cropOrganized(const pcl::PointCloud<pcl::PointXYZRGBA> &in,
+                     pcl::PointCloud<pcl::PointXYZRGBA> &out, const CropBox &box)
+{
+  if(&in == &out)
+  {
+    return cropOrganized(out, box);
+  }
+
+  const float nan = std::numeric_limits<float>::quiet_NaN();
+  out.header = in.header;
+  out.width = in.width;
+  out.height = in.height;
+  out.sensor_origin_ = in.sensor_origin_;
+  out.sensor_orientation_ = in.sensor_orientation_;
+  out.points.resize(in.points.size());
+
+  size_t kept = 0;
+  for(size_t i = 0; i < in.points.size(); ++i)
+  {
+    const pcl::PointXYZRGBA &p = in.points[i];
+    pcl::PointXYZRGBA &o = out.points[i];
+    o = p;
+    if(box.contains(p.x, p.y, p.z))
+    {
+      ++kept;
+    }
+    else
+    {
+      o.x = o.y = o.z = nan;
+    }
+  }
+  out.is_dense = kept == out.points.size();
+  return kept;
+}
+
+void cropIndices(const pcl::PointCloud<pcl::PointXYZRGBA> &cloud, const CropBox &box,
+                 std::vector<int> &indices)
+{
+  indices.clear();
+  for(size_t i = 0; i < cloud.points.size(); ++i)
+  {
+    const pcl::PointXYZRGBA &p = cloud.points[i];
+    if(box.contains(p.x, p.y, p.z))
+    {
+      indices.push_back(static_cast<int>(i));
+    }
+  }
+}
+
+}
@@ -0,0 +1,63 @@
+#include <rs_refills/utils/hash_voxel_grid.h>
+
+namespace rs_refills
+{
+
+void HashVoxelGrid::voxelize(const Cloud &cloud, const std::vector<int> &indices, Cloud &voxels, Sources &sources)
+{
+  size_t tableSize = 16;
+  while(tableSize < 2 * indices.size())
+    tableSize <<= 1;
+  const uint64_t tableMask = tableSize - 1;
+  keys_.resize(tableSize);
+  slots_.assign(tableSize, -1);
+  pointVoxel_.resize(indices.size());
+  counts_.clear();
+  sums_.clear();
+
+  //voxel of every point, linear probing
+  for(size_t k = 0; k < indices.size(); ++k)
+  {
+    const Eigen::Vector3f p = cloud.points[indices[k]].getVector3fMap();
+    const uint64_t voxelKey = key(p, leafSize_);
+    uint64_t slot = ((voxelKey * 0x9E3779B97F4A7C15ull) >> 32) & tableMask;
+    while(slots_[slot] >= 0 && keys_[slot] != voxelKey)
+      slot = (slot + 1) & tableMask;
+    if(slots_[slot] < 0)
+    {
+      slots_[slot] = counts_.size();
+      keys_[slot] = voxelKey;
+      counts_.push_back(0);
+      sums_.push_back(Eigen::Vector3f::Zero());
+    }
+    const int voxel = slots_[slot];
+    pointVoxel_[k] = voxel;
+    ++counts_[voxel];
+    sums_[voxel] += p;
+  }
+
+  //counting sort of the points into their voxels
+  const size_t firstVoxel = sources.size();
+  sources.start.resize(firstVoxel + counts_.size() + 1);
+  for(size_t v = 0; v < counts_.size(); ++v)
+    sources.start[firstVoxel + v + 1] = sources.start[firstVoxel + v] + counts_[v];
+  sources.indices.resize(sources.indices.size() + indices.size());
+  //counts_ becomes the fill position of each voxel
+  for(size_t v = 0; v < counts_.size(); ++v)
+    counts_[v] = sources.start[firstVoxel + v];
+  for(size_t k = 0; k < indices.size(); ++k)
+    sources.indices[counts_[pointVoxel_[k]]++] = indices[k];
+
+  for(size_t v = 0; v < sums_.size(); ++v)
+  {
+    const int first = sources.start[firstVoxel + v];
+    pcl::PointXYZRGBA pt = cloud.points[sources.indices[first]];
+    pt.getVector3fMap() = sums_[v] / (sources.start[firstVoxel + v + 1] - first);
+    voxels.points.push_back(pt);
+  }
+  voxels.width = voxels.points.size();
+  voxels.height = 1;
+  voxels.is_dense = true;
+}
+
+}
@@ -0,0 +1,220 @@
+#include <rs_refills/utils/line_extractor.h>
+
+#include <algorithm>
+#include <limits>
+
+namespace rs_refills
+{
+
+LineExtractor::LineExtractor(): cloud_(NULL), minX_(0), minZ_(0), cellSize_(0), cellsX_(0), cellsZ_(0)
+{
+}
+
+void LineExtractor::setInputCloud(const pcl::PointCloud<pcl::PointXYZRGBA> &cloud)
+{
+  cloud_ = &cloud;
+  cellSize_ = params_.sampleMaxDist;
+  rng_.seed(params_.seed);
+
+  const size_t n = cloud.points.size();
+  active_.clear();
+  isActive_.assign(n, 0);
+  taken_.assign(n, 0);
+  pointCell_.assign(n, -1);
+
+  float maxX = -std::numeric_limits<float>::max(), maxZ = -std::numeric_limits<float>::max();
+  minX_ = std::numeric_limits<float>::max();
+  minZ_ = std::numeric_limits<float>::max();
+  for(size_t i = 0; i < n; ++i)
+  {
+    const pcl::PointXYZRGBA &p = cloud.points[i];
+    if(!std::isfinite(p.x) || !std::isfinite(p.z))
+      continue;
+    minX_ = std::min(minX_, p.x);
+    minZ_ = std::min(minZ_, p.z);
+    maxX = std::max(maxX, p.x);
+    maxZ = std::max(maxZ, p.z);
+    active_.push_back(static_cast<int>(i));
+    isActive_[i] = 1;
+  }
+
+  if(active_.empty())
+  {
+    cellsX_ = cellsZ_ = 0;
+    cellStart_.assign(1, 0);
+    cellPoints_.clear();
+    return;
+  }
+
+  cellsX_ = static_cast<int>((maxX - minX_) / cellSize_) + 1;
+  cellsZ_ = static_cast<int>((maxZ - minZ_) / cellSize_) + 1;
+
+  //counting sort of the points into their cells
+  cellStart_.assign(cellsX_ * cellsZ_ + 1, 0);
+  for(int i : active_)
+  {
+    const pcl::PointXYZRGBA &p = cloud.points[i];
+    const int cx = std::min(cellsX_ - 1, static_cast<int>((p.x - minX_) / cellSize_));
+    const int cz = std::min(cellsZ_ - 1, static_cast<int>((p.z - minZ_) / cellSize_));
+    pointCell_[i] = cz * cellsX_ + cx;
+    ++cellStart_[pointCell_[i] + 1];
+  }
+  for(size_t c = 1; c < cellStart_.size(); ++c)
+    cellStart_[c] += cellStart_[c - 1];
+
+  cellPoints_.resize(active_.size());
+  std::vector<int> fill(cellStart_.begin(), cellStart_.end() - 1);
+  for(int i : active_)
+    cellPoints_[fill[pointCell_[i]]++] = i;
+}
+
+bool LineExtractor::drawHypothesis(Eigen::Vector2f &point, Eigen::Vector2f &dir)
+{
+  std::uniform_int_distribution<size_t> pick(0, active_.size() - 1);
+  const int first = active_[pick(rng_)];
+  const pcl::PointXYZRGBA &p1 = cloud_->points[first];
+
+  //second sample has to be within sampleMaxDist, so the 3x3 neighborhood is enough
+  const int cx = pointCell_[first] % cellsX_;
+  const int cz = pointCell_[first] / cellsX_;
+  const float maxDistSqr = params_.sampleMaxDist * params_.sampleMaxDist;
+  candidates_.clear();
+  for(int z = std::max(0, cz - 1); z <= std::min(cellsZ_ - 1, cz + 1); ++z)
+  {
+    for(int x = std::max(0, cx - 1); x <= std::min(cellsX_ - 1, cx + 1); ++x)
+    {
+      const int cell = z * cellsX_ + x;
+      for(int k = cellStart_[cell]; k < cellStart_[cell + 1]; ++k)
+      {
+        const int idx = cellPoints_[k];
+        if(idx == first || !isActive_[idx])
+          continue;
+        const pcl::PointXYZRGBA &p = cloud_->points[idx];
+        const float dx = p.x - p1.x, dz = p.z - p1.z;
+        if(dx * dx + dz * dz <= maxDistSqr)
+          candidates_.push_back(idx);
+      }
+    }
+  }
+  if(candidates_.empty())
+    return false;
+
+  std::uniform_int_distribution<size_t> pickSecond(0, candidates_.size() - 1);
+  const pcl::PointXYZRGBA &p2 = cloud_->points[candidates_[pickSecond(rng_)]];
+  dir = Eigen::Vector2f(p2.x - p1.x, p2.z - p1.z);
+  const float norm = dir.norm();
+  if(norm < std::numeric_limits<float>::epsilon())
+    return false;
+  dir /= norm;
+
+  //parallel to x in either direction
+  if(std::abs(dir[1]) > std::sin(params_.epsAngle))
+    return false;
+
+  point = Eigen::Vector2f(p1.x, p1.z);
+  return true;
+}
+
+size_t LineExtractor::countInliers(const Eigen::Vector2f &point, const Eigen::Vector2f &dir,
+                                   std::vector<int> *inliers) const
+{
+  size_t count = 0;
+  for(int idx : active_)
+  {
+    if(inliers && taken_[idx])
+      continue;
+    const pcl::PointXYZRGBA &p = cloud_->points[idx];
+    const float dist = std::abs((p.x - point[0]) * dir[1] - (p.z - point[1]) * dir[0]);
+    if(dist <= params_.distanceThreshold)
+    {
+      ++count;
+      if(inliers)
+        inliers->push_back(idx);
+    }
+  }
+  return count;
+}
+
+size_t LineExtractor::findLines(std::vector<std::vector<int>> &inliers, std::vector<Eigen::VectorXf> &coefficients,
+                                size_t minInliers)
+{
+  inliers.clear();
+  coefficients.clear();
+  if(!cloud_ || active_.size() < std::max<size_t>(2, minInliers))
+    return 0;
+
+  //drawing stays sequential so that the hypotheses only depend on the seed
+  hypotheses_.clear();
+  int skipped = 0;
+  while(static_cast<int>(hypotheses_.size()) < params_.hypothesesPerRound && skipped < params_.hypothesesPerRound * 10)
+  {
+    Hypothesis h;
+    if(drawHypothesis(h.point, h.dir))
+      hypotheses_.push_back(h);
+    else
+      ++skipped;
+  }
+
+  #pragma omp parallel for schedule(static)
+  for(int i = 0; i < static_cast<int>(hypotheses_.size()); ++i)
+  {
+    hypotheses_[i].score = countInliers(hypotheses_[i].point, hypotheses_[i].dir, NULL);
+  }
+
+  std::vector<int> order(hypotheses_.size());
+  for(size_t i = 0; i < order.size(); ++i)
+    order[i] = static_cast<int>(i);
+  std::stable_sort(order.begin(), order.end(), [this](int a, int b)
+  {
+    return this->hypotheses_[a].score > this->hypotheses_[b].score;
+  });
+
+  //greedy: a hypothesis is only taken if enough of its inliers are not claimed by a better line
+  const float xCenter = 0.5f * (2 * minX_ + cellsX_ * cellSize_);
+  std::vector<float> acceptedZ;
+  for(int i : order)
+  {
+    const Hypothesis &h = hypotheses_[i];
+    if(h.score < minInliers)
+      break;
+
+    //near duplicate of an accepted line, compare the heights at the center of the cloud
+    const float z = h.point[1] + (xCenter - h.point[0]) * h.dir[1] / h.dir[0];
+    bool duplicate = false;
+    for(float az : acceptedZ)
+      duplicate |= std::abs(az - z) < 2 * params_.distanceThreshold;
+    if(duplicate)
+      continue;
+
+    std::vector<int> lineInliers;
+    countInliers(h.point, h.dir, &lineInliers);
+    if(lineInliers.size() < minInliers)
+      continue;
+
+    for(int idx : lineInliers)
+      taken_[idx] = 1;
+    acceptedZ.push_back(z);
+
+    Eigen::VectorXf coeffs(6);
+    coeffs << h.point[0], cloud_->points[lineInliers[0]].y, h.point[1], h.dir[0], 0.0f, h.dir[1];
+    coefficients.push_back(coeffs);
+    inliers.push_back(std::move(lineInliers));
+  }
+
+  for(const std::vector<int> &line : inliers)
+    for(int idx : line)
+      taken_[idx] = 0;
+  return inliers.size();
+}
+
+void LineExtractor::removePoints(const std::vector<int> &indices)
+{
+  for(int idx : indices)
+    isActive_[idx] = 0;
+  active_.erase(std::remove_if(active_.begin(), active_.end(), [this](int idx)
+  {
+    return !this->isActive_[idx];
+  }), active_.end());
+}
+
+}
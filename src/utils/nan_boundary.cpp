@@ -0,0 +1,93 @@
+#include <rs_refills/utils/nan_boundary.h>
+
+namespace rs_refills
+{
+
+void NanBoundaryExtractor::copyRow(const ValidityMask &valid, int width, int v)
+{
+  //rows start at any bit of the mask
+  const size_t offset = static_cast<size_t>(v) * width;
+  const size_t first = offset >> 6, shift = offset & 63;
+  const uint64_t *words = valid.words();
+  const size_t numWords = valid.numWords();
+  uint64_t *row = &rows_[v * rowWords_];
+  for(int k = 0; k < rowWords_; ++k)
+  {
+    const uint64_t lo = first + k < numWords ? words[first + k] : 0;
+    const uint64_t hi = first + k + 1 < numWords ? words[first + k + 1] : 0;
+    row[k] = shift ? (lo >> shift) | (hi << (64 - shift)) : lo;
+  }
+  if(width & 63)
+    row[rowWords_ - 1] &= (uint64_t(1) << (width & 63)) - 1;
+}
+
+void NanBoundaryExtractor::boundaryRow(int width, int v)
+{
+  const uint64_t *rows[3] = {&rows_[(v - 1) * rowWords_], &rows_[v * rowWords_], &rows_[(v + 1) * rowWords_]};
+  uint64_t *boundary = &boundaryBits_[v * rowWords_];
+  int count = 0;
+  for(int k = 0; k < rowWords_; ++k)
+  {
+    //bit u is set if the 3x3 neighborhood of column u is valid
+    uint64_t neighborhood = ~uint64_t(0);
+    for(const uint64_t *r : rows)
+    {
+      const uint64_t left = (r[k] << 1) | (k > 0 ? r[k - 1] >> 63 : 0);
+      const uint64_t right = (r[k] >> 1) | (k + 1 < rowWords_ ? r[k + 1] << 63 : 0);
+      neighborhood &= r[k] & left & right;
+    }
+    uint64_t bits = rows[1][k] & ~neighborhood;
+    //first and last column are never boundaries, same as pcl
+    if(k == 0)
+      bits &= ~uint64_t(1);
+    if(k == (width - 1) >> 6)
+      bits &= ~(uint64_t(1) << ((width - 1) & 63));
+    boundary[k] = bits;
+    count += __builtin_popcountll(bits);
+  }
+  rowStart_[v + 1] = count;
+}
+
+size_t NanBoundaryExtractor::extract(const ValidityMask &valid, int width, int height, std::vector<int> &boundary)
+{
+  boundary.clear();
+  if(width < 3 || height < 3 || valid.size() != static_cast<size_t>(width) * height)
+    return 0;
+
+  rowWords_ = (width + 63) / 64;
+  rows_.resize(height * rowWords_);
+  boundaryBits_.resize(height * rowWords_);
+  rowStart_.assign(height + 1, 0);
+
+  #pragma omp parallel for schedule(static)
+  for(int v = 0; v < height; ++v)
+    copyRow(valid, width, v);
+
+  //first and last row are never boundaries, their counts stay 0
+  #pragma omp parallel for schedule(static)
+  for(int v = 1; v < height - 1; ++v)
+    boundaryRow(width, v);
+
+  for(int v = 0; v < height; ++v)
+    rowStart_[v + 1] += rowStart_[v];
+  boundary.resize(rowStart_[height]);
+
+  #pragma omp parallel for schedule(static)
+  for(int v = 1; v < height - 1; ++v)
+  {
+    const uint64_t *bits = &boundaryBits_[v * rowWords_];
+    int *out = boundary.data() + rowStart_[v];
+    for(int k = 0; k < rowWords_; ++k)
+    {
+      uint64_t b = bits[k];
+      while(b)
+      {
+        *out++ = v * width + k * 64 + __builtin_ctzll(b);
+        b &= b - 1;
+      }
+    }
+  }
+  return boundary.size();
+}
+
+}
@@ -0,0 +1,85 @@
+#include <rs_refills/utils/organized_outlier_filter.h>
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+namespace rs_refills
+{
+
+size_t OrganizedOutlierFilter::filter(pcl::PointCloud<pcl::PointXYZRGBA> &cloud, ValidityMask &valid)
+{
+  const int width = cloud.width, height = cloud.height, r = params_.windowRadius;
+  const int windowSize = (2 * r + 1) * (2 * r + 1);
+  meanDistances_.resize(cloud.points.size());
+
+  double sum = 0.0, sumSq = 0.0;
+  long count = 0;
+  #pragma omp parallel reduction(+:sum, sumSq, count)
+  {
+    //distances to the candidates of one point, one buffer per thread
+    std::vector<float> distances(windowSize);
+    #pragma omp for schedule(static)
+    for(int v = 0; v < height; ++v)
+    {
+      const int v0 = std::max(0, v - r), v1 = std::min(height - 1, v + r);
+      for(int u = 0; u < width; ++u)
+      {
+        const size_t i = v * width + u;
+        if(!valid.test(i))
+          continue;
+        const Eigen::Vector3f p = cloud.points[i].getVector3fMap();
+        const int u0 = std::max(0, u - r), u1 = std::min(width - 1, u + r);
+        int neighbors = 0;
+        for(int nv = v0; nv <= v1; ++nv)
+        {
+          for(int nu = u0; nu <= u1; ++nu)
+          {
+            const size_t j = nv * width + nu;
+            if(j == i || !valid.test(j))
+              continue;
+            distances[neighbors++] = (cloud.points[j].getVector3fMap() - p).norm();
+          }
+        }
+        if(neighbors == 0)
+        {
+          meanDistances_[i] = std::numeric_limits<float>::infinity();
+          continue;
+        }
+        const int k = std::min(neighbors, params_.meanK);
+        std::nth_element(distances.begin(), distances.begin() + (k - 1), distances.begin() + neighbors);
+        float dist = 0.0f;
+        for(int n = 0; n < k; ++n)
+          dist += distances[n];
+        const float mean = dist / k;
+        meanDistances_[i] = mean;
+        sum += mean;
+        sumSq += mean * mean;
+        ++count;
+      }
+    }
+  }
+
+  if(count == 0)
+    return 0;
+
+  //same estimate as pcl::StatisticalOutlierRemoval
+  const double mean = sum / count;
+  const double variance = count > 1 ? (sumSq - sum * sum / count) / (count - 1) : 0.0;
+  const float threshold = mean + params_.stddevMul * std::sqrt(std::max(0.0, variance));
+
+  //reset sequentially, neighboring rows share the words of the mask
+  size_t removed = 0;
+  valid.forEachValid([&](size_t i)
+  {
+    if(meanDistances_[i] <= threshold)
+      return;
+    pcl::PointXYZRGBA &p = cloud.points[i];
+    p.x = p.y = p.z = std::numeric_limits<float>::quiet_NaN();
+    valid.reset(i);
+    ++removed;
+  });
+  return removed;
+}
+
+}
@@ -0,0 +1,258 @@
+#include <rs_refills/utils/organized_transform.h>
+
+#include <algorithm>
+#include <limits>
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define RS_REFILLS_X86_SIMD
+#include <immintrin.h>
+#endif
+
+namespace rs_refills
+{
+
+namespace
+{
+
+typedef pcl::PointXYZRGBA PointT;
+
+void prepareOutput(const pcl::PointCloud<PointT> &in, pcl::PointCloud<PointT> &out, ValidityMask &mask)
+{
+  if(&in != &out)
+  {
+    out.header = in.header;
+    out.width = in.width;
+    out.height = in.height;
+    out.sensor_origin_ = in.sensor_origin_;
+    out.sensor_orientation_ = in.sensor_orientation_;
+    out.points.resize(in.points.size());
+  }
+  mask.resize(in.points.size());
+}
+
+inline bool transformPoint(const PointT &p, PointT &o, const Eigen::Matrix4f &m, const CropBox &box)
+{
+  const float x = m(0, 0) * p.x + m(0, 1) * p.y + m(0, 2) * p.z + m(0, 3);
+  const float y = m(1, 0) * p.x + m(1, 1) * p.y + m(1, 2) * p.z + m(1, 3);
+  const float z = m(2, 0) * p.x + m(2, 1) * p.y + m(2, 2) * p.z + m(2, 3);
+  o.rgba = p.rgba;
+  o.data[3] = 1.0f;
+  //NaN input stays NaN after the transform and fails the box test
+  if(box.contains(x, y, z))
+  {
+    o.x = x;
+    o.y = y;
+    o.z = z;
+    return true;
+  }
+  o.x = o.y = o.z = std::numeric_limits<float>::quiet_NaN();
+  return false;
+}
+
+size_t kernelScalar(const PointT *in, PointT *out, size_t n, const Eigen::Matrix4f &m,
+                    const CropBox &box, uint64_t *mask)
+{
+  size_t kept = 0;
+  for(size_t base = 0; base < n; base += 64)
+  {
+    const size_t end = std::min(n, base + 64);
+    uint64_t bits = 0;
+    for(size_t i = base; i < end; ++i)
+    {
+      if(transformPoint(in[i], out[i], m, box))
+      {
+        bits |= uint64_t(1) << (i - base);
+        ++kept;
+      }
+    }
+    mask[base >> 6] = bits;
+  }
+  return kept;
+}
+
+#ifdef RS_REFILLS_X86_SIMD
+
+//one point per register: x,y,z,w of a PointXYZRGBA are the first 16 bytes
+size_t kernelSSE(const PointT *in, PointT *out, size_t n, const Eigen::Matrix4f &m,
+                 const CropBox &box, uint64_t *mask)
+{
+  const float nanf = std::numeric_limits<float>::quiet_NaN();
+  const __m128 c0 = _mm_setr_ps(m(0, 0), m(1, 0), m(2, 0), 0.0f);
+  const __m128 c1 = _mm_setr_ps(m(0, 1), m(1, 1), m(2, 1), 0.0f);
+  const __m128 c2 = _mm_setr_ps(m(0, 2), m(1, 2), m(2, 2), 0.0f);
+  const __m128 c3 = _mm_setr_ps(m(0, 3), m(1, 3), m(2, 3), 1.0f);
+  //w is always 1 after the transform unless the input was NaN, limits let it pass
+  const __m128 lo = _mm_setr_ps(box.minX, box.minY, box.minZ, 0.0f);
+  const __m128 hi = _mm_setr_ps(box.maxX, box.maxY, box.maxZ, 2.0f);
+  const __m128 invalid = _mm_setr_ps(nanf, nanf, nanf, 1.0f);
+
+  size_t kept = 0;
+  for(size_t base = 0; base < n; base += 64)
+  {
+    const size_t end = std::min(n, base + 64);
+    uint64_t bits = 0;
+    for(size_t i = base; i < end; ++i)
+    {
+      const __m128 p = _mm_loadu_ps(in[i].data);
+      const uint32_t rgba = in[i].rgba;
+      __m128 r = _mm_add_ps(_mm_mul_ps(c0, _mm_shuffle_ps(p, p, 0x00)), c3);
+      r = _mm_add_ps(_mm_mul_ps(c1, _mm_shuffle_ps(p, p, 0x55)), r);
+      r = _mm_add_ps(_mm_mul_ps(c2, _mm_shuffle_ps(p, p, 0xAA)), r);
+      const __m128 inside = _mm_and_ps(_mm_cmpge_ps(r, lo), _mm_cmple_ps(r, hi));
+      if(_mm_movemask_ps(inside) == 0xF)
+      {
+        _mm_storeu_ps(out[i].data, r);
+        bits |= uint64_t(1) << (i - base);
+        ++kept;
+      }
+      else
+      {
+        _mm_storeu_ps(out[i].data, invalid);
+      }
+      out[i].rgba = rgba;
+    }
+    mask[base >> 6] = bits;
+  }
+  return kept;
+}
+
+//two points per register, one in each 128 bit lane
+__attribute__((target("avx2,fma")))
+size_t kernelAVX2(const PointT *in, PointT *out, size_t n, const Eigen::Matrix4f &m,
+                  const CropBox &box, uint64_t *mask)
+{
+  const float nanf = std::numeric_limits<float>::quiet_NaN();
+  const __m256 c0 = _mm256_setr_ps(m(0, 0), m(1, 0), m(2, 0), 0.0f, m(0, 0), m(1, 0), m(2, 0), 0.0f);
+  const __m256 c1 = _mm256_setr_ps(m(0, 1), m(1, 1), m(2, 1), 0.0f, m(0, 1), m(1, 1), m(2, 1), 0.0f);
+  const __m256 c2 = _mm256_setr_ps(m(0, 2), m(1, 2), m(2, 2), 0.0f, m(0, 2), m(1, 2), m(2, 2), 0.0f);
+  const __m256 c3 = _mm256_setr_ps(m(0, 3), m(1, 3), m(2, 3), 1.0f, m(0, 3), m(1, 3), m(2, 3), 1.0f);
+  const __m256 lo = _mm256_setr_ps(box.minX, box.minY, box.minZ, 0.0f, box.minX, box.minY, box.minZ, 0.0f);
+  const __m256 hi = _mm256_setr_ps(box.maxX, box.maxY, box.maxZ, 2.0f, box.maxX, box.maxY, box.maxZ, 2.0f);
+  const __m128 invalid = _mm_setr_ps(nanf, nanf, nanf, 1.0f);
+
+  size_t kept = 0;
+  for(size_t base = 0; base < n; base += 64)
+  {
+    const size_t end = std::min(n, base + 64);
+    uint64_t bits = 0;
+    size_t i = base;
+    for(; i + 1 < end; i += 2)
+    {
+      const __m256 p = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(in[i].data)),
+                                            _mm_loadu_ps(in[i + 1].data), 1);
+      const uint32_t rgba0 = in[i].rgba, rgba1 = in[i + 1].rgba;
+      __m256 r = _mm256_fmadd_ps(c0, _mm256_permute_ps(p, 0x00), c3);
+      r = _mm256_fmadd_ps(c1, _mm256_permute_ps(p, 0x55), r);
+      r = _mm256_fmadd_ps(c2, _mm256_permute_ps(p, 0xAA), r);
+      const int inside = _mm256_movemask_ps(_mm256_and_ps(_mm256_cmp_ps(r, lo, _CMP_GE_OQ),
+                                                          _mm256_cmp_ps(r, hi, _CMP_LE_OQ)));
+      if((inside & 0xF) == 0xF)
+      {
+        _mm_storeu_ps(out[i].data, _mm256_castps256_ps128(r));
+        bits |= uint64_t(1) << (i - base);
+        ++kept;
+      }
+      else
+      {
+        _mm_storeu_ps(out[i].data, invalid);
+      }
+      if((inside >> 4) == 0xF)
+      {
+        _mm_storeu_ps(out[i + 1].data, _mm256_extractf128_ps(r, 1));
+        bits |= uint64_t(1) << (i + 1 - base);
+        ++kept;
+      }
+      else
+      {
+        _mm_storeu_ps(out[i + 1].data, invalid);
+      }
+      out[i].rgba = rgba0;
+      out[i + 1].rgba = rgba1;
+    }
+    if(i < end && transformPoint(in[i], out[i], m, box))
+    {
+      bits |= uint64_t(1) << (i - base);
+      ++kept;
+    }
+    mask[base >> 6] = bits;
+  }
+  return kept;
+}
+
+#endif
+
+}
+
+SimdLevel detectSimdLevel()
+{
+#ifdef RS_REFILLS_X86_SIMD
+  static const SimdLevel level = (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) ?
+                                 SimdLevel::AVX2 : SimdLevel::SSE;
+  return level;
+#else
+  return SimdLevel::SCALAR;
+#endif
+}
+
+const char *simdLevelName(SimdLevel level)
+{
+  switch(level)
+  {
+  case SimdLevel::AUTO:
+    return simdLevelName(detectSimdLevel());
+  case SimdLevel::SCALAR:
+    return "scalar";
+  case SimdLevel::SSE:
+    return "sse";
+  case SimdLevel::AVX2:
+    return "avx2";
+  }
+  return "unknown";
+}
+
+size_t transformAndCrop(const pcl::PointCloud<pcl::PointXYZRGBA> &in,
+                        pcl::PointCloud<pcl::PointXYZRGBA> &out,
+                        const Eigen::Affine3f &transform, const CropBox &box,
+                        ValidityMask &mask, SimdLevel level)
+{
+  prepareOutput(in, out, mask);
+  if(level == SimdLevel::AUTO || level > detectSimdLevel())
+    level = detectSimdLevel();
+
+  const Eigen::Matrix4f m = transform.matrix();
+  const size_t n = in.points.size();
+  size_t kept = 0;
+  switch(level)
+  {
+#ifdef RS_REFILLS_X86_SIMD
+  case SimdLevel::AVX2:
+    kept = kernelAVX2(in.points.data(), out.points.data(), n, m, box, mask.words());
+    break;
+  case SimdLevel::SSE:
+    kept = kernelSSE(in.points.data(), out.points.data(), n, m, box, mask.words());
+    break;
+#endif
+  default:
+    kept = kernelScalar(in.points.data(), out.points.data(), n, m, box, mask.words());
+    break;
+  }
+  out.is_dense = kept == n;
+  return kept;
+}
+
+size_t transformAndCrop(const pcl::PointCloud<pcl::PointXYZRGBA> &in,
+                        pcl::PointCloud<pcl::PointXYZRGBA> &out,
+                        const Eigen::Affine3f &transform, const CropBox &box)
+{
+  ValidityMask mask;
+  return transformAndCrop(in, out, transform, box, mask);
+}
+
+size_t transformOrganized(const pcl::PointCloud<pcl::PointXYZRGBA> &in,
+                          pcl::PointCloud<pcl::PointXYZRGBA> &out,
+                          const Eigen::Affine3f &transform, ValidityMask &mask)
+{
+  return transformAndCrop(in, out, transform, CropBox(), mask);
+}
+
+}
@@ -0,0 +1,110 @@
+#include <rs_refills/utils/product_dims_cache.h>
+
+#include <chrono>
+#include <fstream>
+#include <sstream>
+
+namespace rs_refills
+{
+
+ProductDimsCache::ProductDimsCache(double ttl): ttl_(ttl), hits_(0), misses_(0)
+{
+}
+
+int64_t ProductDimsCache::now()
+{
+  return std::chrono::duration_cast<std::chrono::seconds>(
+           std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+std::string ProductDimsCache::key(const std::string &product)
+{
+  std::string k = product;
+  const size_t hash = k.find_last_of('#');
+  if(hash != std::string::npos)
+    k = k.substr(hash + 1);
+  else if(k.compare(0, 5, "shop:") == 0)
+    k = k.substr(5);
+  //quotes of prolog atoms
+  if(!k.empty() && k.front() == '\'')
+    k.erase(0, 1);
+  if(!k.empty() && k.back() == '\'')
+    k.pop_back();
+  return k;
+}
+
+bool ProductDimsCache::lookup(const std::string &product, ProductDims &dims)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = entries_.find(key(product));
+  if(it == entries_.end() || (ttl_ > 0.0 && now() - it->second.stamp > ttl_))
+  {
+    misses_.fetch_add(1, std::memory_order_relaxed);
+    return false;
+  }
+  hits_.fetch_add(1, std::memory_order_relaxed);
+  dims = it->second.dims;
+  return true;
+}
+
+void ProductDimsCache::insert(const std::string &product, const ProductDims &dims)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  Entry &entry = entries_[key(product)];
+  entry.dims = dims;
+  entry.stamp = now();
+}
+
+int ProductDimsCache::load(const std::string &file)
+{
+  std::ifstream in(file.c_str());
+  if(!in.good())
+    return -1;
+
+  const int64_t loaded = now();
+  int count = 0;
+  std::string line;
+  std::lock_guard<std::mutex> lock(mutex_);
+  while(std::getline(in, line))
+  {
+    std::istringstream fields(line);
+    std::string product;
+    Entry entry;
+    if(!(fields >> product >> entry.dims.height >> entry.dims.width >> entry.dims.depth))
+      continue;
+    if(!(fields >> entry.stamp))
+      entry.stamp = loaded;
+    entries_[key(product)] = entry;
+    ++count;
+  }
+  return count;
+}
+
+bool ProductDimsCache::save(const std::string &file) const
+{
+  std::ofstream out(file.c_str());
+  if(!out.good())
+    return false;
+  out.precision(9);
+  std::lock_guard<std::mutex> lock(mutex_);
+  for(const auto &e : entries_)
+  {
+    out << e.first << " " << e.second.dims.height << " " << e.second.dims.width << " "
+        << e.second.dims.depth << " " << e.second.stamp << "\n";
+  }
+  return out.good();
+}
+
+size_t ProductDimsCache::size() const
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  return entries_.size();
+}
+
+void ProductDimsCache::clear()
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  entries_.clear();
+}
+
+}
@@ -0,0 +1,72 @@
+#include <rs_refills/utils/shelf_line_map.h>
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+namespace rs_refills
+{
+
+namespace
+{
+
+inline float distanceYZ(const Eigen::Vector3f &a, const Eigen::Vector3f &b)
+{
+  return std::sqrt((a[1] - b[1]) * (a[1] - b[1]) + (a[2] - b[2]) * (a[2] - b[2]));
+}
+
+}
+
+int ShelfLineMap::find(const Eigen::Vector3f &begin, const Eigen::Vector3f &end) const
+{
+  //only layers whose begin height is within the match distance can match
+  auto it = std::lower_bound(byHeight_.begin(), byHeight_.end(),
+                             std::make_pair(begin[2] - matchDistance_, std::numeric_limits<int>::min()));
+  int best = -1;
+  float bestDist = std::numeric_limits<float>::max();
+  for(; it != byHeight_.end() && it->first <= begin[2] + matchDistance_; ++it)
+  {
+    const Layer &layer = layers_[it->second];
+    const float distb = distanceYZ(layer.begin.mean, begin);
+    const float diste = distanceYZ(layer.end.mean, end);
+    if(distb < matchDistance_ && diste < matchDistance_ && distb + diste < bestDist)
+    {
+      bestDist = distb + diste;
+      best = it->second;
+    }
+  }
+  return best;
+}
+
+void ShelfLineMap::update(int id, const Eigen::Vector3f &begin, const Eigen::Vector3f &end, float weight)
+{
+  Layer &layer = layers_[id];
+  const float oldHeight = layer.begin.mean[2];
+  layer.begin.add(begin, weight);
+  layer.end.add(end, weight);
+  reindex(id, oldHeight);
+}
+
+int ShelfLineMap::insert(const Eigen::Vector3f &begin, const Eigen::Vector3f &end, float weight)
+{
+  Layer layer;
+  layer.id = static_cast<int>(layers_.size());
+  layer.begin.add(begin, weight);
+  layer.end.add(end, weight);
+  layers_.push_back(layer);
+
+  std::pair<float, int> key(layer.begin.mean[2], layer.id);
+  byHeight_.insert(std::upper_bound(byHeight_.begin(), byHeight_.end(), key), key);
+  return layer.id;
+}
+
+void ShelfLineMap::reindex(int id, float oldHeight)
+{
+  std::pair<float, int> oldKey(oldHeight, id);
+  auto it = std::lower_bound(byHeight_.begin(), byHeight_.end(), oldKey);
+  byHeight_.erase(it);
+  std::pair<float, int> key(layers_[id].begin.mean[2], id);
+  byHeight_.insert(std::upper_bound(byHeight_.begin(), byHeight_.end(), key), key);
+}
+
+}
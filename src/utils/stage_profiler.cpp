@@ -0,0 +1,146 @@
+#include <rs_refills/utils/stage_profiler.h>
+
+#include <algorithm>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+
+namespace rs_refills
+{
+
+LatencyHistogram::LatencyHistogram(): buckets_(NUM_BUCKETS)
+{
+  reset();
+}
+
+size_t LatencyHistogram::bucketOf(uint64_t value)
+{
+  //values below 8 get a bucket each, above that 8 buckets per power of two
+  if(value < 8)
+    return value;
+  const int msb = 63 - __builtin_clzll(value);
+  const size_t bucket = (msb - 2) * 8 + ((value >> (msb - 3)) & 7);
+  return bucket < NUM_BUCKETS ? bucket : NUM_BUCKETS - 1;
+}
+
+uint64_t LatencyHistogram::bucketUpperBound(size_t bucket)
+{
+  if(bucket < 8)
+    return bucket;
+  const int msb = bucket / 8 + 2;
+  const uint64_t sub = bucket % 8;
+  return ((8 + sub + 1) << (msb - 3)) - 1;
+}
+
+void LatencyHistogram::record(uint64_t microseconds)
+{
+  buckets_[bucketOf(microseconds)].fetch_add(1, std::memory_order_relaxed);
+  count_.fetch_add(1, std::memory_order_relaxed);
+  sum_.fetch_add(microseconds, std::memory_order_relaxed);
+  uint64_t prev = max_.load(std::memory_order_relaxed);
+  while(prev < microseconds && !max_.compare_exchange_weak(prev, microseconds, std::memory_order_relaxed))
+  {
+  }
+}
+
+double LatencyHistogram::mean() const
+{
+  const uint64_t n = count();
+  return n ? static_cast<double>(sum_.load(std::memory_order_relaxed)) / n : 0.0;
+}
+
+uint64_t LatencyHistogram::percentile(double p) const
+{
+  const uint64_t n = count();
+  if(n == 0)
+    return 0;
+  const uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(p * n + 0.5));
+  uint64_t seen = 0;
+  for(size_t b = 0; b < NUM_BUCKETS; ++b)
+  {
+    seen += buckets_[b].load(std::memory_order_relaxed);
+    if(seen >= rank)
+      return std::min(bucketUpperBound(b), max());
+  }
+  return max();
+}
+
+void LatencyHistogram::merge(const LatencyHistogram &other)
+{
+  for(size_t b = 0; b < NUM_BUCKETS; ++b)
+    buckets_[b].fetch_add(other.buckets_[b].load(std::memory_order_relaxed), std::memory_order_relaxed);
+  count_.fetch_add(other.count(), std::memory_order_relaxed);
+  sum_.fetch_add(other.sum_.load(std::memory_order_relaxed), std::memory_order_relaxed);
+  const uint64_t otherMax = other.max();
+  uint64_t prev = max_.load(std::memory_order_relaxed);
+  while(prev < otherMax && !max_.compare_exchange_weak(prev, otherMax, std::memory_order_relaxed))
+  {
+  }
+}
+
+void LatencyHistogram::reset()
+{
+  for(auto &b : buckets_)
+    b.store(0, std::memory_order_relaxed);
+  count_.store(0, std::memory_order_relaxed);
+  sum_.store(0, std::memory_order_relaxed);
+  max_.store(0, std::memory_order_relaxed);
+}
+
+StageProfiler::StageProfiler(const std::vector<std::string> &stageNames): names_(stageNames)
+{
+  for(size_t i = 0; i < names_.size(); ++i)
+    histograms_.push_back(std::unique_ptr<LatencyHistogram>(new LatencyHistogram()));
+}
+
+std::string StageProfiler::report() const
+{
+  std::ostringstream out;
+  out << std::left << std::setw(20) << "stage" << std::right
+      << std::setw(8) << "count" << std::setw(10) << "mean" << std::setw(10) << "p50"
+      << std::setw(10) << "p95" << std::setw(10) << "p99" << std::setw(10) << "max" << "  [ms]" << std::endl;
+  out << std::fixed << std::setprecision(3);
+  for(size_t i = 0; i < names_.size(); ++i)
+  {
+    const LatencyHistogram &h = *histograms_[i];
+    if(h.count() == 0)
+      continue;
+    out << std::left << std::setw(20) << names_[i] << std::right
+        << std::setw(8) << h.count()
+        << std::setw(10) << h.mean() / 1000.0
+        << std::setw(10) << h.percentile(0.5) / 1000.0
+        << std::setw(10) << h.percentile(0.95) / 1000.0
+        << std::setw(10) << h.percentile(0.99) / 1000.0
+        << std::setw(10) << h.max() / 1000.0 << std::endl;
+  }
+  return out.str();
+}
+
+bool StageProfiler::writeReport(const std::string &file) const
+{
+  return writeReports(file, {this});
+}
+
+bool StageProfiler::writeReports(const std::string &file, const std::vector<const StageProfiler *> &profilers)
+{
+  std::ofstream out(file.c_str());
+  if(!out.good())
+    return false;
+  for(const StageProfiler *profiler : profilers)
+    out << profiler->report();
+  return out.good();
+}
+
+void StageProfiler::merge(const StageProfiler &other)
+{
+  for(size_t i = 0; i < std::min(histograms_.size(), other.histograms_.size()); ++i)
+    histograms_[i]->merge(*other.histograms_[i]);
+}
+
+void StageProfiler::reset()
+{
+  for(auto &h : histograms_)
+    h->reset();
+}
+
+}